@@ -0,0 +1,44 @@
+#include <algorithm>
+#include <cassert>
+
+#include "arena.h"
+
+Arena::Arena(std::size_t block_size, std::size_t retain) : retain(retain), current(0), offset(0), blockSize(block_size), capacity(0) {}
+
+unsigned char* Arena::Allocate(std::size_t size) {
+	// blocks kept from earlier bursts are reused if they're big enough
+	for (; current < blocks.size(); current++, offset = 0) {
+		if (blocks[current].size - offset >= size) {
+			auto data = blocks[current].data.get() + offset;
+			offset += size;
+			return data;
+		}
+	}
+	
+	auto block_size = std::max(blockSize, size);
+	blocks.push_back(Block { std::unique_ptr<unsigned char[]>(new unsigned char[block_size]), block_size });
+	capacity += block_size;
+	offset = size;
+	return blocks[current].data.get();
+}
+
+Arena::Mark Arena::Top() const {
+	return Mark { current, offset };
+}
+
+void Arena::Release(Mark mark) {
+	current = mark.block;
+	offset = mark.offset;
+}
+
+void Arena::Trim() {
+	assert(current == 0 && offset == 0);
+	while (capacity > retain) {
+		capacity -= blocks.back().size;
+		blocks.pop_back();
+	}
+}
+
+std::size_t Arena::Capacity() const {
+	return capacity;
+}
@@ -0,0 +1,40 @@
+#include <cstddef>
+#include <memory>
+#include <vector>
+
+// bump allocator for scratch memory that's freed in LIFO order
+// blocks are never moved, so memory handed out stays valid until released even if the arena grows
+class Arena {
+public:
+	struct Mark {
+		std::size_t block;
+		std::size_t offset;
+	};
+	
+	Arena(std::size_t block_size, std::size_t retain);
+	
+	unsigned char* Allocate(std::size_t size);
+	
+	// everything allocated after Top was called is released together
+	Mark Top() const;
+	void Release(Mark mark);
+	
+	// frees blocks beyond retain, call only when everything has been released
+	void Trim();
+	
+	std::size_t Capacity() const;
+	
+	std::size_t retain;
+	
+private:
+	struct Block {
+		std::unique_ptr<unsigned char[]> data;
+		std::size_t size;
+	};
+	
+	std::vector<Block> blocks;
+	std::size_t current; // block we're bumping in
+	std::size_t offset;
+	std::size_t blockSize;
+	std::size_t capacity;
+};
@@ -1,3 +1,7 @@
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+
 #include <cryptopp/modes.h>
 
 #include "cmclient.h"
@@ -5,12 +9,36 @@
 const char* MAGIC = "VT01";
 std::uint32_t PROTO_MASK = 0x80000000;
 
-SteamClient::CMClient::CMClient(std::function<void(std::size_t, std::function<void(unsigned char*)>)> write) : write(std::move(write)) {
+// for when they're bound to references, as std::min does
+const std::size_t SteamClient::CMClient::JOB_WHEEL_SIZE;
+const std::size_t SteamClient::CMClient::MESSAGE_RETAIN;
+
+SteamClient::CMClient::CMClient(
+	std::function<void(std::size_t, std::function<void(unsigned char*)>)> write,
+	std::function<void(const Buffer[], std::size_t)> writev,
+	std::function<void()> want_write
+) : write(std::move(write)), writev(std::move(writev)), wantWrite(std::move(want_write)), protoHeaderSize(0), ivsLeft(0), arenaMessages(0), inflating(0), arena(16 * 1024, 256 * 1024), nextJobID(1), jobClock(0), corked(0), queueOffset(0), inFlight(0), queued(0), staleAcks(0), backpressured(false), pool(nullptr) {
 	steamID.instance = 1;
 	steamID.universe = static_cast<unsigned>(EUniverse::Public);
 	steamID.type = static_cast<unsigned>(EAccountType::Individual);
 }
 
+SteamClient::CMClient::~CMClient() {
+	if (strand) {
+		// workers might still be using us, and completions already posted must not
+		strand->Wait();
+		strand->closed = true;
+	}
+	
+	for (auto job : spareJobs) {
+		delete job;
+	}
+	
+	for (auto& inflater : inflaters) {
+		inflateEnd(inflater.get());
+	}
+}
+
 void SteamClient::CMClient::WriteMessage(EMsg emsg, std::size_t length, const std::function<void(unsigned char*)> &fill) {
 	if (emsg == EMsg::ChannelEncryptResponse) {
 		WritePacket(sizeof(MsgHdr) + length, [emsg, &fill](unsigned char* buffer) {
@@ -29,58 +57,491 @@ void SteamClient::CMClient::WriteMessage(EMsg emsg, std::size_t length, const st
 	}
 }
 
-void SteamClient::CMClient::WriteMessage(EMsg emsg, const google::protobuf::Message &message, std::uint64_t job_id) {
-	CMsgProtoBufHeader proto;
-	proto.set_steamid(steamID);
-	proto.set_client_sessionid(sessionID);
-	if (job_id) {
-		proto.set_jobid_target(job_id);
+std::size_t SteamClient::CMClient::ProtoHeaderSize(std::uint64_t target_job_id, std::uint64_t source_job_id) {
+	if (!protoHeaderSize || protoHeaderSteamID != steamID || protoHeaderSessionID != sessionID) {
+		CMsgProtoBufHeader proto;
+		proto.set_steamid(steamID);
+		proto.set_client_sessionid(sessionID);
+		protoHeaderSize = proto.ByteSize();
+		assert(protoHeaderSize <= sizeof(protoHeader));
+		proto.SerializeToArray(protoHeader, protoHeaderSize);
+		protoHeaderSteamID = steamID;
+		protoHeaderSessionID = sessionID;
+	}
+	
+	return protoHeaderSize + (source_job_id ? 1 + 8 : 0) + (target_job_id ? 1 + 8 : 0);
+}
+
+void SteamClient::CMClient::WriteProtoHeader(byte* output, std::uint64_t target_job_id, std::uint64_t source_job_id) {
+	// call ProtoHeaderSize first
+	std::copy(protoHeader, protoHeader + protoHeaderSize, output);
+	output += protoHeaderSize;
+	
+	// jobid_source and jobid_target are fields 10 and 11 and fixed64, after everything in the template
+	if (source_job_id) {
+		output[0] = CMsgProtoBufHeader::kJobidSourceFieldNumber << 3 | 1;
+		*reinterpret_cast<std::uint64_t*>(output + 1) = source_job_id;
+		output += 1 + 8;
+	}
+	if (target_job_id) {
+		output[0] = CMsgProtoBufHeader::kJobidTargetFieldNumber << 3 | 1;
+		*reinterpret_cast<std::uint64_t*>(output + 1) = target_job_id;
 	}
-	auto proto_size = proto.ByteSize();
+}
+
+void SteamClient::CMClient::WriteMessage(EMsg emsg, const google::protobuf::Message &message, std::uint64_t target_job_id, std::uint64_t source_job_id) {
+	// sizes are computed once here, everything below serializes with the cached ones
+	auto proto_size = ProtoHeaderSize(target_job_id, source_job_id);
 	auto message_size = message.ByteSize();
-	WritePacket(sizeof(MsgHdrProtoBuf) + proto_size + message_size, [emsg, &proto, proto_size, &message, message_size](unsigned char* buffer) {
+	
+	if (writev && !encrypted && !corked) {
+		// nothing to encrypt, so let the transport gather the pieces instead of assembling a packet
+		unsigned char header_buffer[8 + sizeof(MsgHdrProtoBuf) + sizeof(protoHeader) + 2 * (1 + 8)];
+		
+		auto header_size = sizeof(MsgHdrProtoBuf) + proto_size;
+		*reinterpret_cast<std::uint32_t*>(header_buffer) = header_size + message_size;
+		std::copy(MAGIC, MAGIC + 4, header_buffer + 4);
+		
+		auto header = new (header_buffer + 8) MsgHdrProtoBuf;
+		header->headerLength = proto_size;
+		header->msg = static_cast<std::uint32_t>(emsg) | PROTO_MASK;
+		WriteProtoHeader(header->proto, target_job_id, source_job_id);
+		
+		if (writeBuffer.size() < static_cast<std::size_t>(message_size))
+			writeBuffer.resize(message_size);
+		message.SerializeWithCachedSizesToArray(writeBuffer.data());
+		
+		Buffer buffers[] = {
+			{ header_buffer, 8 },
+			{ header_buffer + 8, header_size },
+			{ writeBuffer.data(), static_cast<std::size_t>(message_size) }
+		};
+		writev(buffers, 3);
+		return;
+	}
+	
+	WritePacket(sizeof(MsgHdrProtoBuf) + proto_size + message_size, [this, emsg, target_job_id, source_job_id, proto_size, &message, message_size](unsigned char* buffer) {
 		auto header = new (buffer) MsgHdrProtoBuf;
 		header->headerLength = proto_size;
 		header->msg = static_cast<std::uint32_t>(emsg) | PROTO_MASK;
-		proto.SerializeToArray(header->proto, proto_size);
-		message.SerializeToArray(header->proto + proto_size, message_size);
+		WriteProtoHeader(header->proto, target_job_id, source_job_id);
+		message.SerializeWithCachedSizesToArray(header->proto + proto_size);
 	});
 }
 
 
+void SteamClient::CMClient::EnableEncryption() {
+	// expand the key schedules now so that packets only pay for the cipher itself
+	byte iv[16] = {};
+	ivEncryption.SetKey(sessionKey, sizeof(sessionKey));
+	ivDecryption.SetKey(sessionKey, sizeof(sessionKey));
+	encryption.SetKeyWithIV(sessionKey, sizeof(sessionKey), iv);
+	decryption.SetKeyWithIV(sessionKey, sizeof(sessionKey), iv);
+	
+	encrypted = true;
+}
+
+void SteamClient::CMClient::GenerateIV(byte iv[16]) {
+	if (!ivsLeft) {
+		rnd.GenerateBlock(ivs, sizeof(ivs));
+		ivsLeft = sizeof(ivs) / 16;
+	}
+	
+	auto next = ivs + sizeof(ivs) - ivsLeft-- * 16;
+	std::copy(next, next + 16, iv);
+}
+
 void SteamClient::CMClient::WritePacket(const std::size_t length, const std::function<void(unsigned char* buffer)> &fill) {
-	if (encrypted) {
-		auto crypted_size = 16 + (length / 16 + 1) * 16; // IV + crypted message padded to multiple of 16
+	if (encrypted && strand) {
+		// fill has to run now, but the encryption can happen on a worker
+		auto job = NewJob(8 + 16 + (length / 16 + 1) * 16);
+		fill(job->data() + 8 + 16);
 		
-		write(8 + crypted_size, [&](unsigned char* out_buffer) {
-			auto in_buffer = new unsigned char[length];
-			fill(in_buffer);
-			
-			byte iv[16];
-			rnd.GenerateBlock(iv, 16);
-			
-			auto crypted_iv = out_buffer + 8;
-			ECB_Mode<AES>::Encryption(sessionKey, sizeof(sessionKey)).ProcessData(crypted_iv, iv, sizeof(iv));
-			
-			auto crypted_data = crypted_iv + 16;
-			CBC_Mode<AES>::Encryption e(sessionKey, sizeof(sessionKey), iv);
-			ArraySource(
-				in_buffer,
-				length,
-				true,
-				new StreamTransformationFilter(e, new ArraySink(crypted_data, crypted_size - 16))
-			);
-			
-			*reinterpret_cast<std::uint32_t*>(out_buffer) = crypted_size;
-			std::copy(MAGIC, MAGIC + 4, out_buffer + 4);
+		auto strand = this->strand;
+		auto generation = strand->generation;
+		pool->Submit(strand, [this, job, length, strand, generation] {
+			EncryptPacket(job->data(), length);
 			
-			delete[] in_buffer;
+			post([this, job, strand, generation] {
+				if (strand->closed) {
+					delete job;
+					return;
+				}
+				
+				if (strand->generation == generation) {
+					Emit(job->size(), [job](unsigned char* buffer) {
+						std::copy(job->begin(), job->end(), buffer);
+					});
+				}
+				
+				spareJobs.push_back(job);
+			});
 		});
+		
+		return;
+	}
+	
+	auto packet_size = 8 + (encrypted ? 16 + (length / 16 + 1) * 16 : length); // IV + crypted message padded to multiple of 16
+	
+	Emit(packet_size, [&](unsigned char* buffer) {
+		BuildPacket(buffer, length, fill);
+	});
+}
+
+void SteamClient::CMClient::Emit(std::size_t packet_size, const std::function<void(unsigned char* buffer)> &build) {
+	if (wantWrite) {
+		Enqueue(packet_size, build);
+	} else if (corked) {
+		auto offset = corkBuffer.size();
+		corkBuffer.resize(offset + packet_size);
+		build(corkBuffer.data() + offset);
+	} else if (write) {
+		write(packet_size, build);
 	} else {
-		write(8 + length, [&](unsigned char* buffer) {
-			*reinterpret_cast<std::uint32_t*>(buffer) = length;
-			std::copy(MAGIC, MAGIC + 4, buffer + 4);
-			fill(buffer + 8);
+		if (writeBuffer.size() < packet_size)
+			writeBuffer.resize(packet_size);
+		
+		build(writeBuffer.data());
+		
+		Buffer buffer = { writeBuffer.data(), packet_size };
+		writev(&buffer, 1);
+	}
+}
+
+void SteamClient::CMClient::Enqueue(std::size_t packet_size, const std::function<void(unsigned char* buffer)> &build) {
+	if (queue.empty() || queue.back().capacity() - queue.back().size() < packet_size) {
+		// doesn't fit - start a new block, since growing the old one could move data the transport is still sending
+		queue.emplace_back();
+		auto &block = queue.back();
+		if (spareBlock.capacity() >= packet_size)
+			block.swap(spareBlock);
+		block.reserve(std::max<std::size_t>(packet_size, 64 * 1024));
+	}
+	
+	auto &block = queue.back();
+	auto offset = block.size();
+	block.resize(offset + packet_size); // within capacity
+	build(block.data() + offset);
+	
+	auto was_empty = !queued;
+	queued += packet_size;
+	
+	if (!backpressured && queued > highWatermark) {
+		backpressured = true;
+		backpressure();
+	}
+	
+	if (was_empty) {
+		wantWrite();
+	}
+}
+
+void SteamClient::CMClient::Flush() {
+	if (corkBuffer.empty())
+		return;
+	
+	if (write) {
+		write(corkBuffer.size(), [this](unsigned char* buffer) {
+			std::copy(corkBuffer.begin(), corkBuffer.end(), buffer);
 		});
+	} else {
+		Buffer buffer = { corkBuffer.data(), corkBuffer.size() };
+		writev(&buffer, 1);
+	}
+	
+	corkBuffer.clear(); // keeps the capacity for the next batch
+}
+
+void SteamClient::CMClient::BuildPacket(unsigned char* out_buffer, const std::size_t length, const std::function<void(unsigned char* buffer)> &fill) {
+	if (encrypted) {
+		// the plaintext goes straight where the ciphertext will be, then gets padded and encrypted in place
+		fill(out_buffer + 8 + 16);
+		EncryptPacket(out_buffer, length);
+	} else {
+		*reinterpret_cast<std::uint32_t*>(out_buffer) = length;
+		std::copy(MAGIC, MAGIC + 4, out_buffer + 4);
+		fill(out_buffer + 8);
+	}
+}
+
+void SteamClient::CMClient::EncryptPacket(unsigned char* out_buffer, std::size_t length) {
+	auto crypted_size = 16 + (length / 16 + 1) * 16; // IV + crypted message padded to multiple of 16
+	
+	*reinterpret_cast<std::uint32_t*>(out_buffer) = crypted_size;
+	std::copy(MAGIC, MAGIC + 4, out_buffer + 4);
+	
+	byte iv[16];
+	GenerateIV(iv);
+	
+	auto crypted_iv = out_buffer + 8;
+	ivEncryption.ProcessData(crypted_iv, iv, sizeof(iv));
+	
+	auto crypted_data = crypted_iv + 16;
+	auto padding = static_cast<byte>(crypted_size - 16 - length); // PKCS #7
+	std::fill(crypted_data + length, crypted_data + crypted_size - 16, padding);
+	
+	encryption.Resynchronize(iv);
+	encryption.ProcessData(crypted_data, crypted_data, crypted_size - 16);
+}
+
+std::size_t SteamClient::CMClient::DecryptPacket(const unsigned char* input, std::size_t length, unsigned char* output) {
+	// the IV and at least one block, anything else can't have come from Steam
+	if (length < 16 + 16 || length % 16) {
+		return 0;
+	}
+	
+	byte iv[16];
+	ivDecryption.ProcessData(iv, input, 16);
+	
+	auto crypted_data = input + 16;
+	auto crypted_size = length - 16;
+	
+	decryption.Resynchronize(iv);
+	decryption.ProcessData(output, crypted_data, crypted_size);
+	
+	// strip the PKCS #7 padding ourselves instead of going through a StreamTransformationFilter
+	auto padding = output[crypted_size - 1];
+	if (padding < 1 || padding > 16) {
+		return 0;
+	}
+	auto padding_begin = output + crypted_size - padding;
+	if (std::find_if(padding_begin, output + crypted_size, [padding](byte b) { return b != padding; }) != output + crypted_size) {
+		// every padding byte has to match, like StreamTransformationFilter checked
+		return 0;
+	}
+	
+	return crypted_size - padding;
+}
+
+std::vector<byte>* SteamClient::CMClient::NewJob(std::size_t size) {
+	std::vector<byte>* job;
+	if (spareJobs.empty()) {
+		job = new std::vector<byte>;
+	} else {
+		job = spareJobs.back();
+		spareJobs.pop_back();
+	}
+	job->resize(size);
+	return job;
+}
+
+SteamClient::CMClient::MessagePool::MessagePool() : used(0) {}
+
+google::protobuf::Message& SteamClient::CMClient::NewMessage(EMsg emsg, const google::protobuf::Message& prototype, std::size_t length) {
+	if (length > MESSAGE_RETAIN) {
+		handedOut.push_back(nullptr);
+		arenaMessages++;
+		return *prototype.New(&messageArena);
+	}
+	
+	auto& pool = messagePools[static_cast<std::uint32_t>(emsg)];
+	handedOut.push_back(&pool);
+	
+	if (pool.used == pool.messages.size()) {
+		pool.messages.emplace_back(prototype.New());
+	}
+	
+	auto& message = *pool.messages[pool.used++];
+	assert(message.GetDescriptor() == prototype.GetDescriptor());
+	message.Clear();
+	return message;
+}
+
+void SteamClient::CMClient::ReleaseMessages(std::size_t mark) {
+	while (handedOut.size() > mark) {
+		auto pool = handedOut.back();
+		handedOut.pop_back();
+		
+		if (pool) {
+			// it's the last one its pool handed out
+			pool->used--;
+		} else if (!--arenaMessages) {
+			messageArena.Reset();
+		}
+	}
+}
+
+void SteamClient::CMClient::Unzip(const byte* zip, std::size_t zip_length, std::size_t output_length, const std::function<void(const byte* data, std::size_t length)>& dispatch) {
+	// Valve's archives always hold a single file named "z", so the local file header is all we need
+	// anything else is corrupt and dropped, as is whatever follows the first broken sub-message
+	if (zip_length < 30 + 1 || *reinterpret_cast<const std::uint32_t*>(zip) != 0x04034B50) { // local file header signature
+		return;
+	}
+	auto method = *reinterpret_cast<const std::uint16_t*>(zip + 8);
+	auto crc = *reinterpret_cast<const std::uint32_t*>(zip + 14);
+	auto name_length = *reinterpret_cast<const std::uint16_t*>(zip + 26);
+	auto extra_length = *reinterpret_cast<const std::uint16_t*>(zip + 28);
+	assert(name_length == 1 && zip[30] == 'z');
+	
+	std::size_t offset = 30 + name_length + extra_length;
+	if (offset > zip_length) {
+		return;
+	}
+	
+	if (method == 0) {
+		// stored, nothing to inflate
+		if (zip_length - offset < output_length) {
+			return;
+		}
+		assert(crc32(0, zip + offset, output_length) == crc);
+		for (std::size_t start = 0; output_length - start >= 4;) {
+			std::size_t sub_size = *reinterpret_cast<const std::uint32_t*>(zip + offset + start);
+			if (output_length - start - 4 < sub_size) {
+				break;
+			}
+			dispatch(zip + offset + start + 4, sub_size);
+			start += 4 + sub_size;
+		}
+		return;
+	}
+	
+	if (method != 8) { // deflate
+		return;
+	}
+	
+	if (inflating == inflaters.size()) {
+		inflaters.emplace_back(new z_stream);
+		auto& stream = *inflaters.back();
+		stream.zalloc = Z_NULL;
+		stream.zfree = Z_NULL;
+		stream.opaque = Z_NULL;
+		stream.next_in = Z_NULL;
+		stream.avail_in = 0;
+		auto result = inflateInit2(&stream, -MAX_WBITS);
+		assert(result == Z_OK);
+	} else {
+		inflateReset(inflaters[inflating].get());
+	}
+	
+	// the vector may grow under a nested Multi, the z_stream itself stays put
+	auto& stream = *inflaters[inflating++];
+	
+	auto mark = arena.Top();
+	auto window_size = std::min<std::size_t>(output_length, 16 * 1024);
+	auto window = arena.Allocate(window_size);
+	
+	// the central directory follows the data, inflate stops on its own before that
+	stream.next_in = const_cast<byte*>(zip + offset);
+	stream.avail_in = zip_length - offset;
+	
+	std::size_t start = 0, end = 0;
+#ifndef NDEBUG
+	auto checksum = crc32(0, Z_NULL, 0);
+#endif
+	auto result = Z_OK;
+	while (result != Z_STREAM_END) {
+		stream.next_out = window + end;
+		stream.avail_out = window_size - end;
+		result = inflate(&stream, Z_NO_FLUSH);
+		if (result != Z_OK && result != Z_STREAM_END) {
+			// corrupt or truncated, or Z_BUF_ERROR because there's nothing left to make progress with
+			break;
+		}
+#ifndef NDEBUG
+		checksum = crc32(checksum, window + end, window_size - stream.avail_out - end);
+#endif
+		end = window_size - stream.avail_out;
+		
+		// hand off every sub-message that's complete
+		while (end - start >= 4) {
+			auto sub_size = *reinterpret_cast<const std::uint32_t*>(window + start);
+			if (end - start - 4 < sub_size) {
+				break;
+			}
+			dispatch(window + start + 4, sub_size);
+			start += 4 + sub_size;
+		}
+		
+		// slide the incomplete one to the front and make sure it will fit
+		if (start) {
+			std::copy(window + start, window + end, window);
+			end -= start;
+			start = 0;
+		}
+		if (end >= 4) {
+			std::size_t sub_size = *reinterpret_cast<const std::uint32_t*>(window);
+			if (sub_size > output_length) {
+				// can't be right, and we'd only allocate its bogus size
+				result = Z_DATA_ERROR;
+				break;
+			}
+			if (window_size < 4 + sub_size) {
+				// nested Multis are done with their windows by now, so ours is on top again
+				// released memory isn't touched until it's allocated again, and memmove copes if that's right here
+				arena.Release(mark);
+				window_size = std::max<std::size_t>(4 + sub_size, 2 * window_size);
+				auto grown = arena.Allocate(window_size);
+				std::memmove(grown, window, end);
+				window = grown;
+			}
+		}
+	}
+	
+	arena.Release(mark);
+	if (!--inflating) {
+		// the burst is over, don't hold on to more than we were told to
+		arena.Trim();
+	}
+	
+	if (result == Z_STREAM_END) {
+		assert(end == 0);
+		assert(stream.total_out == output_length);
+		assert(checksum == crc);
+	}
+}
+
+std::uint64_t SteamClient::CMClient::StartJob(JobCallback callback, unsigned timeout) {
+	// a job due in the current second would expire before its request is even sent
+	auto deadline = jobClock + std::max(timeout, 1u);
+	auto job_id = nextJobID++;
+	
+	pendingJobs[job_id] = PendingJob { std::move(callback), deadline };
+	jobWheel[deadline % JOB_WHEEL_SIZE].push_back(job_id);
+	return job_id;
+}
+
+bool SteamClient::CMClient::CompleteJob(std::uint64_t job_id, EMsg emsg, const MessageHeader& header, Buffer body) {
+	if (pendingJobs.empty()) {
+		return false;
+	}
+	
+	auto job = pendingJobs.find(job_id);
+	if (job == pendingJobs.end()) {
+		return false;
+	}
+	
+	// the callback may well start the next job
+	auto callback = std::move(job->second.callback);
+	pendingJobs.erase(job);
+	callback(EResult::OK, emsg, header, body);
+	return true;
+}
+
+void SteamClient::CMClient::ExpireJobs(unsigned elapsed) {
+	// one lap visits every slot, so skip ahead to the last one
+	auto steps = std::min<std::uint64_t>(elapsed, JOB_WHEEL_SIZE);
+	jobClock += elapsed - steps;
+	
+	while (steps--) {
+		auto& slot = jobWheel[++jobClock % JOB_WHEEL_SIZE];
+		
+		// callbacks may start jobs that land in this very slot
+		expiringJobs.swap(slot);
+		for (auto job_id : expiringJobs) {
+			auto job = pendingJobs.find(job_id);
+			if (job == pendingJobs.end()) {
+				continue;
+			}
+			
+			if (job->second.deadline > jobClock) {
+				slot.push_back(job_id);
+				continue;
+			}
+			
+			auto callback = std::move(job->second.callback);
+			pendingJobs.erase(job);
+			callback(EResult::Timeout, EMsg::Invalid, MessageHeader {}, Buffer {});
+		}
+		expiringJobs.clear();
 	}
 }
@@ -1,8 +1,19 @@
+#include <deque>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <cryptopp/modes.h>
 #include <cryptopp/osrng.h>
 
+#include <zlib.h>
+
+#include <google/protobuf/arena.h>
+
 #include "steam++.h"
-#include "steam_language/steam_language_internal.h"
-#include "steammessages_clientserver.pb.h"
+#include "cryptopool.h"
+#include "arena.h"
+#include "steam++_messages.h"
 
 extern const char* MAGIC;
 extern std::uint32_t PROTO_MASK;
@@ -10,20 +21,187 @@ extern std::uint32_t PROTO_MASK;
 using namespace CryptoPP;
 using namespace Steam;
 
+// indexed by EMsg
+// there are thousands of EMsgs but only a few dozen handled ones, so pages are only allocated when needed
+template <typename Handler>
+class HandlerTable {
+public:
+	static const std::size_t PAGE_SIZE = 64;
+	
+	// nullptr if nothing on its page has been set
+	Handler* Find(Steam::EMsg emsg) const {
+		auto index = static_cast<std::size_t>(emsg);
+		auto page = index / PAGE_SIZE;
+		if (page >= pages.size() || !pages[page]) {
+			return nullptr;
+		}
+		return &pages[page][index % PAGE_SIZE];
+	}
+	
+	// allocates its page if needed
+	Handler& operator[](Steam::EMsg emsg) {
+		auto index = static_cast<std::size_t>(emsg);
+		auto page = index / PAGE_SIZE;
+		if (page >= pages.size()) {
+			pages.resize(page + 1);
+		}
+		if (!pages[page]) {
+			pages[page].reset(new Handler[PAGE_SIZE]());
+		}
+		return pages[page][index % PAGE_SIZE];
+	}
+	
+private:
+	std::vector<std::unique_ptr<Handler[]>> pages;
+};
+
+template <typename Handler>
+const std::size_t HandlerTable<Handler>::PAGE_SIZE;
+
 class SteamClient::CMClient {
 public:
-	CMClient(std::function<void(std::size_t length, std::function<void(unsigned char* buffer)> fill)> write);
+	CMClient(
+		std::function<void(std::size_t length, std::function<void(unsigned char* buffer)> fill)> write,
+		std::function<void(const Buffer buffers[], std::size_t count)> writev,
+		std::function<void()> want_write
+	);
+	~CMClient();
 	
 	void WriteMessage(Steam::EMsg emsg, std::size_t length, const std::function<void(unsigned char* buffer)> &fill);
-	void WriteMessage(Steam::EMsg emsg, const google::protobuf::Message& message, std::uint64_t job_id = 0);
+	void WriteMessage(Steam::EMsg emsg, const google::protobuf::Message& message, std::uint64_t target_job_id = 0, std::uint64_t source_job_id = 0);
 	void WritePacket(std::size_t length, const std::function<void(unsigned char* buffer)> &fill);
+	void BuildPacket(unsigned char* out_buffer, std::size_t length, const std::function<void(unsigned char* buffer)> &fill);
+	void EncryptPacket(unsigned char* out_buffer, std::size_t length);
+	std::size_t DecryptPacket(const unsigned char* input, std::size_t length, unsigned char* output); // 0 if it's corrupt
+	void Emit(std::size_t packet_size, const std::function<void(unsigned char* buffer)> &build);
+	void Enqueue(std::size_t packet_size, const std::function<void(unsigned char* buffer)> &build);
+	void Flush();
+	void EnableEncryption();
+	void GenerateIV(byte iv[16]);
+	std::size_t ProtoHeaderSize(std::uint64_t target_job_id, std::uint64_t source_job_id = 0);
+	void WriteProtoHeader(byte* output, std::uint64_t target_job_id, std::uint64_t source_job_id = 0);
+	
+	// for inbound messages, cleared and valid until the handler that asked for them returns
+	// @a length is the size of the body it's going to be parsed from
+	google::protobuf::Message& NewMessage(Steam::EMsg emsg, const google::protobuf::Message& prototype, std::size_t length);
+	void ReleaseMessages(std::size_t mark);
+	void Unzip(const byte* zip, std::size_t zip_length, std::size_t output_length, const std::function<void(const byte* data, std::size_t length)>& dispatch);
 	
+	// exactly one of these is set
 	std::function<void(std::size_t length, std::function<void(unsigned char* buffer)> fill)> write;	
+	std::function<void(const Buffer buffers[], std::size_t count)> writev;
+	std::function<void()> wantWrite;
 	
 	SteamID steamID;
 	std::int32_t sessionID;
 
 	bool encrypted;
 	byte sessionKey[32];
-	AutoSeededRandomPool rnd;
+	
+	// CMsgProtoBufHeader for steamID and sessionID as of the last protobuf we sent, they only change at logon
+	// jobid_source and jobid_target are spliced in after it when needed
+	byte protoHeader[20];
+	std::size_t protoHeaderSize; // 0 until the first one
+	std::uint64_t protoHeaderSteamID;
+	std::int32_t protoHeaderSessionID;
+	
+	// AES-CTR keystream seeded once per session, much cheaper than an AutoSeededRandomPool
+	CTR_Mode<AES>::Encryption rnd;
+	byte ivs[16 * 64]; // generated in bulk
+	unsigned ivsLeft;
+	
+	// keyed once per session in EnableEncryption, only the IV changes per packet
+	ECB_Mode<AES>::Encryption ivEncryption;
+	ECB_Mode<AES>::Decryption ivDecryption;
+	CBC_Mode<AES>::Encryption encryption;
+	CBC_Mode<AES>::Decryption decryption;
+	
+	// decrypted packets go here, grows to fit the largest one
+	std::vector<byte> readBuffer;
+	
+	// incomplete packet passed to feed
+	std::vector<byte> feedBuffer;
+	
+	// inbound messages are pooled per EMsg and handed back as soon as their handler returns, so a single one
+	// serves a whole Multi of that EMsg, more are only needed while a handler runs inside another of the same EMsg
+	// they're only cleared, so their strings and repeated fields keep their capacity for the next one
+	struct MessagePool {
+		MessagePool();
+		
+		std::vector<std::unique_ptr<google::protobuf::Message>> messages;
+		std::size_t used; // handed out right now
+	};
+	std::unordered_map<std::uint32_t, MessagePool> messagePools;
+	std::vector<MessagePool*> handedOut; // one per message, in order, so that they go back last first, nullptr if on messageArena
+	
+	// bodies bigger than MESSAGE_RETAIN are parsed onto this instead, so a pooled message never grows to fit one
+	// it's reset once the last of them is released, which frees all of their strings and repeated fields at once
+	static const std::size_t MESSAGE_RETAIN = 64 * 1024;
+	google::protobuf::Arena messageArena;
+	std::size_t arenaMessages;
+	
+	// see SteamClient::SubscribeRaw, indexed by EMsg
+	std::vector<bool> rawSubscriptions;
+	
+	// see SteamClient::RegisterHandler
+	// empty until it's called, SteamClient's own handlers are shared by every client until then
+	typedef std::function<void(const MessageHeader& header, const unsigned char* data, std::size_t length)> Handler;
+	HandlerTable<Handler> handlers;
+	
+	// raw deflate streams for compressed Multis, reset rather than recreated for each one
+	// one per nesting level since a sub-message is dispatched while its parent is still inflating
+	std::vector<std::unique_ptr<z_stream>> inflaters;
+	unsigned inflating;
+	
+	// the sliding windows they inflate into, nested ones are stacked on top of their parent's
+	Arena arena;
+	
+	// see SteamClient::SendJob
+	// expiry is tracked in a wheel of one-second slots, each holding the IDs of the jobs due in it
+	// completed jobs are left in their slot and skipped, as are jobs more than a lap away
+	typedef std::function<void(EResult result, Steam::EMsg emsg, const MessageHeader& header, Buffer body)> JobCallback;
+	struct PendingJob {
+		JobCallback callback;
+		std::uint64_t deadline; // in jobClock seconds
+	};
+	std::unordered_map<std::uint64_t, PendingJob> pendingJobs;
+	std::uint64_t nextJobID;
+	std::uint64_t jobClock; // seconds of heartbeats so far
+	static const std::size_t JOB_WHEEL_SIZE = 64;
+	std::vector<std::uint64_t> jobWheel[JOB_WHEEL_SIZE];
+	std::vector<std::uint64_t> expiringJobs;
+	std::uint64_t StartJob(JobCallback callback, unsigned timeout);
+	bool CompleteJob(std::uint64_t job_id, Steam::EMsg emsg, const MessageHeader& header, Buffer body);
+	void ExpireJobs(unsigned elapsed);
+	
+	// packets for writev are assembled here
+	std::vector<byte> writeBuffer;
+	
+	// packets written while corked pile up here until Flush
+	unsigned corked;
+	std::vector<byte> corkBuffer;
+	
+	// queued mode: packets are built in blocks that never reallocate, so pending data stays put
+	std::deque<std::vector<byte>> queue;
+	std::vector<byte> spareBlock;
+	std::size_t queueOffset; // already sent from the front block
+	std::size_t inFlight; // handed out by pending from the front block, but not yet sent
+	std::size_t queued; // total unsent
+	
+	// blocks of a previous connection that the transport may still be sending, kept until it says it's done
+	// as acks for what's in flight arrive before any for the new connection, they're simply counted off
+	std::vector<std::vector<byte>> staleBlocks;
+	std::size_t staleAcks;
+	std::size_t highWatermark;
+	std::size_t lowWatermark;
+	bool backpressured;
+	std::function<void()> backpressure;
+	
+	// see SteamClient::offload
+	// only the ciphers, the IV generator and the jobs are touched by the workers
+	CryptoPool::Impl* pool;
+	std::shared_ptr<CryptoPool::Strand> strand;
+	std::function<void(std::function<void()> callback)> post;
+	std::vector<std::vector<byte>*> spareJobs;
+	std::vector<byte>* NewJob(std::size_t size);
 };
@@ -0,0 +1,82 @@
+#include <cassert>
+
+#include "steam++.h"
+#include "cryptopool.h"
+
+CryptoPool::CryptoPool(unsigned threads) : impl(new Impl(threads)) {}
+
+CryptoPool::~CryptoPool() {
+	delete impl;
+}
+
+CryptoPool::Strand::Strand() : scheduled(false), generation(0), closed(false) {}
+
+void CryptoPool::Strand::Wait() {
+	std::unique_lock<std::mutex> lock(mutex);
+	idle.wait(lock, [this] { return !scheduled; });
+}
+
+CryptoPool::Impl::Impl(unsigned threads) : stopping(false) {
+	assert(threads);
+	while (threads--) {
+		workers.emplace_back(&Impl::Run, this);
+	}
+}
+
+CryptoPool::Impl::~Impl() {
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	ready.notify_all();
+	
+	for (auto &worker : workers) {
+		worker.join();
+	}
+}
+
+void CryptoPool::Impl::Submit(const std::shared_ptr<Strand> &strand, std::function<void()> task) {
+	{
+		std::lock_guard<std::mutex> lock(strand->mutex);
+		strand->tasks.push_back(std::move(task));
+		if (strand->scheduled)
+			// whoever is running it will get to this task too
+			return;
+		strand->scheduled = true;
+	}
+	
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		strands.push_back(strand);
+	}
+	ready.notify_one();
+}
+
+void CryptoPool::Impl::Run() {
+	for (;;) {
+		std::shared_ptr<Strand> strand;
+		
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			ready.wait(lock, [this] { return stopping || !strands.empty(); });
+			if (strands.empty())
+				// stopping and nothing left to do
+				return;
+			strand = std::move(strands.front());
+			strands.pop_front();
+		}
+		
+		std::unique_lock<std::mutex> lock(strand->mutex);
+		while (!strand->tasks.empty()) {
+			auto task = std::move(strand->tasks.front());
+			strand->tasks.pop_front();
+			
+			lock.unlock();
+			task();
+			lock.lock();
+		}
+		
+		strand->scheduled = false;
+		strand->idle.notify_all();
+	}
+}
@@ -0,0 +1,43 @@
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+using namespace Steam;
+
+// tasks submitted to the same strand run one at a time and in order, on whichever worker is free
+struct CryptoPool::Strand {
+	Strand();
+	
+	// blocks until every task submitted so far has finished
+	void Wait();
+	
+	std::mutex mutex;
+	std::condition_variable idle;
+	std::deque<std::function<void()>> tasks;
+	bool scheduled; // queued in the pool or being run by a worker
+	
+	// only touched on the client's thread
+	unsigned generation;
+	bool closed;
+};
+
+class CryptoPool::Impl {
+public:
+	Impl(unsigned threads);
+	~Impl();
+	
+	void Submit(const std::shared_ptr<Strand> &strand, std::function<void()> task);
+	
+private:
+	void Run();
+	
+	std::mutex mutex;
+	std::condition_variable ready;
+	std::deque<std::shared_ptr<Strand>> strands;
+	bool stopping;
+	std::vector<std::thread> workers;
+};
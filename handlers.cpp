@@ -2,12 +2,11 @@
 #include <cassert>
 
 #include <cryptopp/crc.h>
+#include <cryptopp/osrng.h>
 #include <cryptopp/rsa.h>
 
-#include <archive.h>
-#include <archive_entry.h>
-
 #include "cmclient.h"
+#include "wire.h"
 
 byte public_key[] = {
 	0x30, 0x81, 0x9D, 0x30, 0x0D, 0x06, 0x09, 0x2A, 0x86, 0x48, 0x86, 0xF7, 0x0D, 0x01, 0x01, 0x01,
@@ -22,307 +21,296 @@ byte public_key[] = {
 	0xE9, 0x63, 0xA2, 0xBB, 0x88, 0x19, 0x28, 0xE0, 0xE7, 0x14, 0xC0, 0x42, 0x89, 0x02, 0x01, 0x11,
 };
 
-void SteamClient::HandleMessage(EMsg emsg, const unsigned char* data, std::size_t length, std::uint64_t job_id) {
-	switch (emsg) {
-	
-	case EMsg::ChannelEncryptRequest:
-		{
-			auto enc_request = reinterpret_cast<const MsgChannelEncryptRequest*>(data);
-			
-			RSA::PublicKey key;
-			ArraySource source(public_key, sizeof(public_key), true /* pumpAll */);
-			key.Load(source);
-			RSAES_OAEP_SHA_Encryptor rsa(key);
-			
-			auto rsa_size = rsa.FixedCiphertextLength();
-			
-			cmClient->WriteMessage(EMsg::ChannelEncryptResponse, sizeof(MsgChannelEncryptResponse) + rsa_size + 4 + 4, [this, &rsa, rsa_size](unsigned char* buffer) {
-				auto enc_resp = new (buffer) MsgChannelEncryptResponse;
-				auto crypted_sess_key = buffer + sizeof(MsgChannelEncryptResponse); 
+SteamClient::BuiltinHandler SteamClient::FindBuiltinHandler(EMsg emsg) {
+	// clients only get a table of their own if they call RegisterHandler
+	static const HandlerTable<BuiltinHandler> builtins = [] {
+		HandlerTable<BuiltinHandler> handlers;
+		
+		handlers[EMsg::ChannelEncryptRequest] = [](SteamClient& client, const MessageHeader& header, const unsigned char* data, std::size_t length) {
+			client.Parse<EMsg::ChannelEncryptRequest>(header, data, length, [&client](const MessageHeader& header, const MsgChannelEncryptRequest& enc_request, const unsigned char* payload, std::size_t length) {
+				RSA::PublicKey key;
+				ArraySource source(public_key, sizeof(public_key), true /* pumpAll */);
+				key.Load(source);
+				RSAES_OAEP_SHA_Encryptor rsa(key);
 				
-				cmClient->rnd.GenerateBlock(cmClient->sessionKey, sizeof(cmClient->sessionKey));
+				auto rsa_size = rsa.FixedCiphertextLength();
 				
-				rsa.Encrypt(cmClient->rnd, cmClient->sessionKey, sizeof(cmClient->sessionKey), crypted_sess_key);
+				// the only time we ask the OS for entropy, everything else comes from the generator
+				byte seed[32 + 16];
+				OS_GenerateRandomBlock(false, seed, sizeof(seed));
+				client.cmClient->rnd.SetKeyWithIV(seed, 32, seed + 32);
+				client.cmClient->ivsLeft = 0;
 				
-				CRC32().CalculateDigest(crypted_sess_key + rsa_size, crypted_sess_key, rsa_size);
-				*reinterpret_cast<std::uint32_t*>(crypted_sess_key + rsa_size + 4) = 0;
+				client.cmClient->WriteMessage(EMsg::ChannelEncryptResponse, sizeof(MsgChannelEncryptResponse) + rsa_size + 4 + 4, [&client, &rsa, rsa_size](unsigned char* buffer) {
+					auto enc_resp = new (buffer) MsgChannelEncryptResponse;
+					auto crypted_sess_key = buffer + sizeof(MsgChannelEncryptResponse); 
+					
+					client.cmClient->rnd.GenerateBlock(client.cmClient->sessionKey, sizeof(client.cmClient->sessionKey));
+					
+					rsa.Encrypt(client.cmClient->rnd, client.cmClient->sessionKey, sizeof(client.cmClient->sessionKey), crypted_sess_key);
+					
+					CRC32().CalculateDigest(crypted_sess_key + rsa_size, crypted_sess_key, rsa_size);
+					*reinterpret_cast<std::uint32_t*>(crypted_sess_key + rsa_size + 4) = 0;
+				});
 			});
-		}
-		
-		break;
-		
-	case EMsg::ChannelEncryptResult:
-		{
-			auto enc_result = reinterpret_cast<const MsgChannelEncryptResult*>(data);
-			assert(enc_result->result == static_cast<std::uint32_t>(EResult::OK));
-			
-			cmClient->encrypted = true;
-			
-			if (onHandshake) {
-				onHandshake();
-			}
-		}
-		
-		break;
+		};
 		
-	case EMsg::Multi:
-		{
-			CMsgMulti msg_multi;
-			msg_multi.ParseFromArray(data, length);
-			auto size_unzipped = msg_multi.size_unzipped();
-			auto payload = msg_multi.message_body();
-			auto data = reinterpret_cast<const unsigned char*>(payload.data());
-			
-			if (size_unzipped > 0) {
-				auto buffer = new unsigned char[size_unzipped];
-				auto archive = archive_read_new();
-				
-				auto result = archive_read_support_filter_all(archive); // I don't see deflate so using all
-				assert(result == ARCHIVE_OK);
-				
-				result = archive_read_support_format_zip(archive);
-				assert(result == ARCHIVE_OK);
-				
-				result = archive_read_open_memory(archive, const_cast<unsigned char*>(data), payload.size());
-				assert(result == ARCHIVE_OK);
-				
-				archive_entry* entry;
-				result = archive_read_next_header(archive, &entry);
-				assert(result == ARCHIVE_OK);
-				assert(archive_entry_pathname(entry) == std::string("z"));
-				assert(archive_entry_size(entry) == size_unzipped);
-				
-				auto length = archive_read_data(archive, buffer, size_unzipped);
-				assert(length == size_unzipped);
+		handlers[EMsg::ChannelEncryptResult] = [](SteamClient& client, const MessageHeader& header, const unsigned char* data, std::size_t length) {
+			client.Parse<EMsg::ChannelEncryptResult>(header, data, length, [&client](const MessageHeader& header, const MsgChannelEncryptResult& enc_result, const unsigned char* payload, std::size_t length) {
+				assert(enc_result.result == static_cast<std::uint32_t>(EResult::OK));
 				
-				assert(archive_read_next_header(archive, &entry) == ARCHIVE_EOF);
+				client.cmClient->EnableEncryption();
 				
-				result = archive_read_free(archive);
-				assert(result == ARCHIVE_OK);
-				
-				data = buffer;
-			}
-			
-			auto payload_size = size_unzipped ? size_unzipped : payload.size();
-			for (unsigned offset = 0; offset < payload_size;) {
-				auto subSize = *reinterpret_cast<const std::uint32_t*>(data + offset);
-				ReadMessage(data + offset + 4, subSize);
-				offset += 4 + subSize;
+				client.listener->onHandshake();
+			});
+		};
+		
+		handlers[EMsg::Multi] = [](SteamClient& client, const MessageHeader& header, const unsigned char* data, std::size_t length) {
+			// CMsgMulti would copy message_body twice, scan for it instead and leave it where it is
+			std::uint32_t size_unzipped = 0;
+			const unsigned char* body = nullptr;
+			std::size_t body_size = 0;
+			
+			WireReader reader(data, length);
+			WireField field;
+			while (reader.Next(field)) {
+				if (field.number == CMsgMulti::kSizeUnzippedFieldNumber && field.type == WireType::Varint) {
+					size_unzipped = field.value;
+				} else if (field.number == CMsgMulti::kMessageBodyFieldNumber && field.type == WireType::LengthDelimited) {
+					body = field.data;
+					body_size = field.length;
+				}
 			}
+			assert(!reader.Failed());
 			
 			if (size_unzipped > 0) {
-				delete[] data;
-			}			
-		}
-		
-		break;
-		
-	case EMsg::ClientLogOnResponse:
-		{
-			CMsgClientLogonResponse logon_resp;
-			logon_resp.ParseFromArray(data, length);
-			auto eresult = static_cast<EResult>(logon_resp.eresult());
-			auto interval = logon_resp.out_of_game_heartbeat_seconds();
-			
-			if (onLogOn) {
-				onLogOn(eresult, cmClient->steamID);
+				// each sub-message is handled as soon as it's inflated
+				client.cmClient->Unzip(body, body_size, size_unzipped, [&client](const unsigned char* data, std::size_t length) {
+					client.ReadMessage(data, length);
+				});
+			} else {
+				// like Unzip, stop at the first sub-message that doesn't fit
+				for (std::size_t offset = 0; body_size - offset >= 4;) {
+					std::size_t subSize = *reinterpret_cast<const std::uint32_t*>(body + offset);
+					if (body_size - offset - 4 < subSize) {
+						break;
+					}
+					client.ReadMessage(body + offset + 4, subSize);
+					offset += 4 + subSize;
+				}
 			}
-			
-			if (eresult == EResult::OK) {
-				setInterval([this] {
-					cmClient->WriteMessage(EMsg::ClientHeartBeat, CMsgClientHeartBeat());
-				}, interval);
-			}			
-		}
+		};
 		
-		break;
+		handlers[EMsg::ClientLogOnResponse] = [](SteamClient& client, const MessageHeader& header, const unsigned char* data, std::size_t length) {
+			client.Parse<EMsg::ClientLogOnResponse>(header, data, length, [&client](const MessageHeader& header, const CMsgClientLogonResponse& logon_resp) {
+				auto eresult = static_cast<EResult>(logon_resp.eresult());
+				auto interval = logon_resp.out_of_game_heartbeat_seconds();
+				
+				client.listener->onLogOn(eresult, client.cmClient->steamID);
+				
+				if (eresult == EResult::OK) {
+					client.setInterval([&client, interval] {
+						client.cmClient->WriteMessage(EMsg::ClientHeartBeat, CMsgClientHeartBeat());
+						client.cmClient->ExpireJobs(interval);
+					}, interval);
+				}
+			});
+		};
 		
-	case EMsg::ClientLoggedOff:
-		{
-			if (!onLogOff) {
+		handlers[EMsg::ClientLoggedOff] = [](SteamClient& client, const MessageHeader& header, const unsigned char* data, std::size_t length) {
+			if (!client.Listening(client.onLogOff)) {
 				return;
 			}
 			
-			CMsgClientLoggedOff logged_off;
-			logged_off.ParseFromArray(data, length);
-			onLogOff(static_cast<EResult>(logged_off.eresult()));
-		}
-		
-		break;
+			client.Parse<EMsg::ClientLoggedOff>(header, data, length, [&client](const MessageHeader& header, const CMsgClientLoggedOff& logged_off) {
+				client.listener->onLogOff(static_cast<EResult>(logged_off.eresult()));
+			});
+		};
 		
-	case EMsg::ClientUpdateMachineAuth:
-		{
-			if (!onSentry) {
+		handlers[EMsg::ClientUpdateMachineAuth] = [](SteamClient& client, const MessageHeader& header, const unsigned char* data, std::size_t length) {
+			if (!client.Listening(client.onSentry)) {
 				return;
 			}
 			
-			CMsgClientUpdateMachineAuth machine_auth;
-			machine_auth.ParseFromArray(data, length);
-			auto &bytes = machine_auth.bytes();
-			
-			byte sha[20];
-			SHA1().CalculateDigest(sha, reinterpret_cast<const byte*>(bytes.data()), bytes.length());
-			
-			CMsgClientUpdateMachineAuthResponse response;
-			response.set_sha_file(sha, 20);
-			cmClient->WriteMessage(EMsg::ClientUpdateMachineAuthResponse, response, job_id);
-			
-			onSentry(sha);
-		}
-		
-		break;
+			client.Parse<EMsg::ClientUpdateMachineAuth>(header, data, length, [&client](const MessageHeader& header, const CMsgClientUpdateMachineAuth& machine_auth) {
+				auto &bytes = machine_auth.bytes();
+				
+				byte sha[20];
+				SHA1().CalculateDigest(sha, reinterpret_cast<const byte*>(bytes.data()), bytes.length());
+				
+				CMsgClientUpdateMachineAuthResponse response;
+				response.set_sha_file(sha, 20);
+				client.cmClient->WriteMessage(EMsg::ClientUpdateMachineAuthResponse, response, header.sourceJobID);
+				
+				client.listener->onSentry(sha);
+			});
+		};
 		
-	case EMsg::ClientPersonaState:
-		{
-			if (!onUserInfo) {
+		handlers[EMsg::ClientPersonaState] = [](SteamClient& client, const MessageHeader& header, const unsigned char* data, std::size_t length) {
+			if (!client.Listening(client.onUserInfo)) {
 				return;
 			}
 			
-			CMsgClientPersonaState state;
-			state.ParseFromArray(data, length);
-			
-			for (auto &user : state.friends()) {
-				SteamID steamid_source = user.steamid_source();
-				auto persona_state = user.persona_state();
-				
-				onUserInfo(
-					user.friendid(),
-					user.has_steamid_source() ? &steamid_source : nullptr,
-					user.has_player_name() ? user.player_name().c_str() : nullptr,
-					user.has_persona_state() ? reinterpret_cast<EPersonaState*>(&persona_state) : nullptr,
-					user.has_avatar_hash() ? reinterpret_cast<const unsigned char*>(user.avatar_hash().data()) : nullptr,
-					user.has_game_name() ? user.game_name().c_str() : nullptr
-				);
-			}
-		}
-		
-		break;
+			client.Parse<EMsg::ClientPersonaState>(header, data, length, [&client](const MessageHeader& header, const CMsgClientPersonaState& state) {
+				for (auto &user : state.friends()) {
+					SteamID steamid_source = user.steamid_source();
+					auto persona_state = user.persona_state();
+					
+					client.listener->onUserInfo(
+						user.friendid(),
+						user.has_steamid_source() ? &steamid_source : nullptr,
+						user.has_player_name() ? user.player_name().c_str() : nullptr,
+						user.has_persona_state() ? reinterpret_cast<EPersonaState*>(&persona_state) : nullptr,
+						user.has_avatar_hash() ? reinterpret_cast<const unsigned char*>(user.avatar_hash().data()) : nullptr,
+						user.has_game_name() ? user.game_name().c_str() : nullptr
+					);
+				}
+			});
+		};
 		
-	case EMsg::ClientChatMsg:
-		{
-			if (!onChatMsg)
+		handlers[EMsg::ClientChatMsg] = [](SteamClient& client, const MessageHeader& header, const unsigned char* data, std::size_t length) {
+			if (!client.Listening(client.onChatMsg))
 				// no listener
 				return;
 			
-			auto msg = reinterpret_cast<const MsgClientChatMsg*>(data);
-			auto begin = reinterpret_cast<const char*>(data + sizeof(MsgClientChatMsg));
-			auto end = reinterpret_cast<const char*>(data + length);
-			
-			// Steam cuts off after the first null or displays the whole string if there isn't one
-			onChatMsg(
-				msg->steamIdChatRoom,
-				msg->steamIdChatter,
-				std::find(begin, end, '\0') == end ?
-					// no null, someone is using a non-conforming implementation
-					std::string(begin, end - begin).c_str() :
-					// null-terminated already, no copy necessary
-					begin
-			);
-		}
-		
-		break;
+			client.Parse<EMsg::ClientChatMsg>(header, data, length, [&client](const MessageHeader& header, const MsgClientChatMsg& msg, const unsigned char* payload, std::size_t length) {
+				auto begin = reinterpret_cast<const char*>(payload);
+				auto end = reinterpret_cast<const char*>(payload + length);
+				
+				// Steam cuts off after the first null or displays the whole string if there isn't one
+				client.listener->onChatMsg(
+					msg.steamIdChatRoom,
+					msg.steamIdChatter,
+					std::find(begin, end, '\0') == end ?
+						// no null, someone is using a non-conforming implementation
+						std::string(begin, end - begin).c_str() :
+						// null-terminated already, no copy necessary
+						begin
+				);
+			});
+		};
 		
-	case EMsg::ClientChatEnter:
-		{
-			if (!onChatEnter)
+		handlers[EMsg::ClientChatEnter] = [](SteamClient& client, const MessageHeader& header, const unsigned char* data, std::size_t length) {
+			if (!client.Listening(client.onChatEnter))
 				return;
 			
-			auto msg = reinterpret_cast<const MsgClientChatEnter*>(data);
-			auto member_count = *reinterpret_cast<const std::uint32_t*>(data + sizeof(MsgClientChatEnter));
-			auto chat_name = reinterpret_cast<const char*>(data + sizeof(MsgClientChatEnter) + 4);
-			
-			// fast-forward to the first byte after the name
-			auto members = chat_name;
-			while (*members++);
-			
-			onChatEnter(
-				msg->steamIdChat,
-				static_cast<EChatRoomEnterResponse>(msg->enterResponse),
-				chat_name,
-				member_count,
-				reinterpret_cast<const ChatMember*>(members)
-			);
-		}
-		
-		break;
+			client.Parse<EMsg::ClientChatEnter>(header, data, length, [&client](const MessageHeader& header, const MsgClientChatEnter& msg, const unsigned char* payload, std::size_t length) {
+				auto member_count = *reinterpret_cast<const std::uint32_t*>(payload);
+				auto chat_name = reinterpret_cast<const char*>(payload + 4);
+				
+				// fast-forward to the first byte after the name
+				auto members = chat_name;
+				while (*members++);
+				
+				client.listener->onChatEnter(
+					msg.steamIdChat,
+					static_cast<EChatRoomEnterResponse>(msg.enterResponse),
+					chat_name,
+					member_count,
+					reinterpret_cast<const ChatMember*>(members)
+				);
+			});
+		};
 		
-	case EMsg::ClientChatMemberInfo:
-		{
-			if (!onChatStateChange)
+		handlers[EMsg::ClientChatMemberInfo] = [](SteamClient& client, const MessageHeader& header, const unsigned char* data, std::size_t length) {
+			if (!client.Listening(client.onChatStateChange))
 				return;
 			
-			auto member_info = reinterpret_cast<const MsgClientChatMemberInfo*>(data);
-			
-			if (static_cast<EChatInfoType>(member_info->type) != EChatInfoType::StateChange)
-				return; // TODO
-			
-			auto payload = data + sizeof(MsgClientChatMemberInfo);
-			
-			auto acted_on = *reinterpret_cast<const SteamID*>(payload);
-			auto state_change = *reinterpret_cast<const EChatMemberStateChange*>(payload + 8);
-			auto acted_by = *reinterpret_cast<const SteamID*>(payload + 8 + 4);
-			auto member = reinterpret_cast<const ChatMember*>(payload + 8 + 4 + 8);
-			
-			onChatStateChange(member_info->steamIdChat, acted_by, acted_on, state_change, member);
-		}
-		
-		break;
+			client.Parse<EMsg::ClientChatMemberInfo>(header, data, length, [&client](const MessageHeader& header, const MsgClientChatMemberInfo& member_info, const unsigned char* payload, std::size_t length) {
+				if (static_cast<EChatInfoType>(member_info.type) != EChatInfoType::StateChange)
+					return; // TODO
+				
+				auto acted_on = *reinterpret_cast<const SteamID*>(payload);
+				auto state_change = *reinterpret_cast<const EChatMemberStateChange*>(payload + 8);
+				auto acted_by = *reinterpret_cast<const SteamID*>(payload + 8 + 4);
+				auto member = reinterpret_cast<const ChatMember*>(payload + 8 + 4 + 8);
+				
+				client.listener->onChatStateChange(member_info.steamIdChat, acted_by, acted_on, state_change, member);
+			});
+		};
 		
-	case EMsg::ClientFriendsList:
-		{
-			if (!onRelationships)
+		handlers[EMsg::ClientFriendsList] = [](SteamClient& client, const MessageHeader& header, const unsigned char* data, std::size_t length) {
+			if (!client.Listening(client.onRelationships))
 				return;
 			
-			CMsgClientFriendsList list;
-			list.ParseFromArray(data, length);
-			
-			std::map<SteamID, EFriendRelationship> users;
-			std::map<SteamID, EClanRelationship> groups;
-			
-			for (auto &relationship : list.friends()) {
-				SteamID steamID = relationship.ulfriendid();
-				if (static_cast<EAccountType>(steamID.type) == EAccountType::Clan) {
-					groups[steamID] = static_cast<EClanRelationship>(relationship.efriendrelationship());
-				} else {
-					users[steamID] = static_cast<EFriendRelationship>(relationship.efriendrelationship());
+			client.Parse<EMsg::ClientFriendsList>(header, data, length, [&client](const MessageHeader& header, const CMsgClientFriendsList& list) {
+				std::map<SteamID, EFriendRelationship> users;
+				std::map<SteamID, EClanRelationship> groups;
+				
+				for (auto &relationship : list.friends()) {
+					SteamID steamID = relationship.ulfriendid();
+					if (static_cast<EAccountType>(steamID.type) == EAccountType::Clan) {
+						groups[steamID] = static_cast<EClanRelationship>(relationship.efriendrelationship());
+					} else {
+						users[steamID] = static_cast<EFriendRelationship>(relationship.efriendrelationship());
+					}
 				}
-			}
-			
-			onRelationships(list.bincremental(), users, groups);
-		}
-		
-		break;
+				
+				client.listener->onRelationships(list.bincremental(), users, groups);
+			});
+		};
 		
-	case EMsg::ClientFriendMsgIncoming:
-		{
-			if (!onPrivateMsg && !onTyping)
+		handlers[EMsg::ClientFriendMsgIncoming] = [](SteamClient& client, const MessageHeader& header, const unsigned char* data, std::size_t length) {
+			if (!client.Listening(client.onPrivateMsg) && !client.Listening(client.onTyping))
 				return;
 			
-			CMsgClientFriendMsgIncoming msg;
-			msg.ParseFromArray(data, length);
-			
-			switch (static_cast<EChatEntryType>(msg.chat_entry_type())) {
-				
-			case EChatEntryType::ChatMsg:
-				if (onPrivateMsg)
-					onPrivateMsg(msg.steamid_from(), msg.message().c_str());
-				break;
-				
-			case EChatEntryType::Typing:
-				if (onTyping)
-					onTyping(msg.steamid_from());
-				break;
-				
-			case EChatEntryType::LeftConversation:
-				// the other party closed the window
-				// not implemented by Steam client
-				break;
-				
-			default:
-				assert(!"Unexpected message type!");
-			}
-		}
+			client.Parse<EMsg::ClientFriendMsgIncoming>(header, data, length, [&client](const MessageHeader& header, const CMsgClientFriendMsgIncoming& msg) {
+				switch (static_cast<EChatEntryType>(msg.chat_entry_type())) {
+					
+				case EChatEntryType::ChatMsg:
+					client.listener->onPrivateMsg(msg.steamid_from(), msg.message().c_str());
+					break;
+					
+				case EChatEntryType::Typing:
+					client.listener->onTyping(msg.steamid_from());
+					break;
+					
+				case EChatEntryType::LeftConversation:
+					// the other party closed the window
+					// not implemented by Steam client
+					break;
+					
+				default:
+					assert(!"Unexpected message type!");
+				}
+			});
+		};
 		
-		break;
+		return handlers;
+	}();
+	
+	auto handler = builtins.Find(emsg);
+	return handler ? *handler : nullptr;
+}
+
+void SteamClient::HandleMessage(EMsg emsg, const MessageHeader& header, const unsigned char* data, std::size_t length) {
+	// responses to our own jobs go to whoever sent the request
+	if (cmClient->CompleteJob(header.targetJobID, emsg, header, Buffer { data, length })) {
+		return;
+	}
+	
+	auto index = static_cast<std::size_t>(emsg);
+	auto subscribed = index < cmClient->rawSubscriptions.size() && cmClient->rawSubscriptions[index];
+	if (subscribed && Listening(onRawMessage)) {
+		listener->onRawMessage(emsg, header, Buffer { data, length });
+	}
+	
+	// a client's own table, if it has one, replaces the built-in handlers on the pages it covers
+	auto mark = cmClient->handedOut.size();
+	auto handled = false;
+	if (auto handler = cmClient->handlers.Find(emsg)) {
+		if (*handler) {
+			(*handler)(header, data, length);
+			handled = true;
+		}
+	} else if (auto builtin = FindBuiltinHandler(emsg)) {
+		builtin(*this, header, data, length);
+		handled = true;
+	}
+	
+	if (handled) {
+		cmClient->ReleaseMessages(mark);
+	} else if (!subscribed && Listening(onRawMessage)) {
+		listener->onRawMessage(emsg, header, Buffer { data, length });
 	}
 }
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cassert>
 #include <cstdlib>
 #include <cstring>
@@ -5,6 +6,7 @@
 #include <cryptopp/modes.h>
 
 #include "cmclient.h"
+#include "wire.h"
 
 SteamID::SteamID(std::uint64_t steamID64) :
 	steamID64(steamID64) {}
@@ -13,12 +15,148 @@ SteamID::operator std::uint64_t() const {
 	return steamID64;
 }
 
+class SteamClient::Callbacks : public SteamClient::Listener {
+public:
+	Callbacks(SteamClient& client) : client(client) {}
+	
+	void onWriteBackpressure() override {
+		if (client.onWriteBackpressure)
+			client.onWriteBackpressure();
+	}
+	
+	void onWriteDrained() override {
+		if (client.onWriteDrained)
+			client.onWriteDrained();
+	}
+	
+	void onHandshake() override {
+		if (client.onHandshake)
+			client.onHandshake();
+	}
+	
+	void onLogOn(EResult result, SteamID steamID) override {
+		if (client.onLogOn)
+			client.onLogOn(result, steamID);
+	}
+	
+	void onLogOff(EResult result) override {
+		if (client.onLogOff)
+			client.onLogOff(result);
+	}
+	
+	void onSentry(const unsigned char hash[20]) override {
+		if (client.onSentry)
+			client.onSentry(hash);
+	}
+	
+	void onUserInfo(
+		SteamID user,
+		SteamID* source,
+		const char* name,
+		EPersonaState* state,
+		const unsigned char avatar_hash[20],
+		const char* game_name
+	) override {
+		if (client.onUserInfo)
+			client.onUserInfo(user, source, name, state, avatar_hash, game_name);
+	}
+	
+	void onChatEnter(
+		SteamID room,
+		EChatRoomEnterResponse response,
+		const char* name,
+		std::size_t member_count,
+		const ChatMember members[]
+	) override {
+		if (client.onChatEnter)
+			client.onChatEnter(room, response, name, member_count, members);
+	}
+	
+	void onChatStateChange(
+		SteamID room,
+		SteamID acted_by,
+		SteamID acted_on,
+		EChatMemberStateChange state_change,
+		const ChatMember* member
+	) override {
+		if (client.onChatStateChange)
+			client.onChatStateChange(room, acted_by, acted_on, state_change, member);
+	}
+	
+	void onChatMsg(SteamID room, SteamID chatter, const char* message) override {
+		if (client.onChatMsg)
+			client.onChatMsg(room, chatter, message);
+	}
+	
+	void onPrivateMsg(SteamID user, const char* message) override {
+		if (client.onPrivateMsg)
+			client.onPrivateMsg(user, message);
+	}
+	
+	void onTyping(SteamID user) override {
+		if (client.onTyping)
+			client.onTyping(user);
+	}
+	
+	void onRelationships(
+		bool incremental,
+		std::map<SteamID, EFriendRelationship> &users,
+		std::map<SteamID, EClanRelationship> &groups
+	) override {
+		if (client.onRelationships)
+			client.onRelationships(incremental, users, groups);
+	}
+	
+	void onRawMessage(EMsg emsg, const MessageHeader& header, Buffer body) override {
+		if (client.onRawMessage)
+			client.onRawMessage(emsg, header, body);
+	}
+	
+private:
+	SteamClient& client;
+};
+
 SteamClient::SteamClient(
 	std::function<void(std::size_t length, std::function<void(unsigned char* buffer)> fill)> write,
-	std::function<void(std::function<void()> callback, int timeout)> set_interval
-) : cmClient(new CMClient(std::move(write))), setInterval(std::move(set_interval)) {}
+	std::function<void(std::function<void()> callback, int timeout)> set_interval,
+	Listener* listener
+) : cmClient(new CMClient(std::move(write), nullptr, nullptr)),
+	callbacks(listener ? nullptr : new Callbacks(*this)),
+	setInterval(std::move(set_interval)) {
+	this->listener = listener ? listener : callbacks;
+}
+
+SteamClient::SteamClient(
+	std::function<void(const Buffer buffers[], std::size_t count)> writev,
+	std::function<void(std::function<void()> callback, int timeout)> set_interval,
+	Listener* listener
+) : cmClient(new CMClient(nullptr, std::move(writev), nullptr)),
+	callbacks(listener ? nullptr : new Callbacks(*this)),
+	setInterval(std::move(set_interval)) {
+	this->listener = listener ? listener : callbacks;
+}
+
+SteamClient::SteamClient(
+	std::function<void()> want_write,
+	std::function<void(std::function<void()> callback, int timeout)> set_interval,
+	std::size_t high_watermark,
+	std::size_t low_watermark,
+	Listener* listener
+) : cmClient(new CMClient(nullptr, nullptr, std::move(want_write))),
+	callbacks(listener ? nullptr : new Callbacks(*this)),
+	setInterval(std::move(set_interval)) {
+	this->listener = listener ? listener : callbacks;
+	
+	assert(low_watermark <= high_watermark);
+	cmClient->highWatermark = high_watermark;
+	cmClient->lowWatermark = low_watermark;
+	cmClient->backpressure = [this] {
+		this->listener->onWriteBackpressure();
+	};
+}
 
 SteamClient::~SteamClient() {
+	delete callbacks;
 	delete cmClient;
 }
 
@@ -45,12 +183,17 @@ void SteamClient::SetPersonaState(EPersonaState state) {
 	cmClient->WriteMessage(EMsg::ClientChangeStatus, change_status);
 }
 
-void SteamClient::JoinChat(SteamID chat) {
+SteamID SteamClient::ChatID(SteamID chat) {
 	if (chat.type == static_cast<unsigned>(EAccountType::Clan)) {
 		// this is a ClanID - convert to its respective ChatID
 		chat.instance = static_cast<unsigned>(0x100000 >> 1); // TODO: this should be defined somewhere else
 		chat.type = static_cast<unsigned>(EAccountType::Chat);
 	}
+	return chat;
+}
+
+void SteamClient::JoinChat(SteamID chat) {
+	chat = ChatID(chat);
 	
 	cmClient->WriteMessage(EMsg::ClientJoinChat, sizeof(MsgClientJoinChat), [&chat](unsigned char* buffer) {
 		auto join_chat = new (buffer) MsgClientJoinChat;
@@ -59,12 +202,7 @@ void SteamClient::JoinChat(SteamID chat) {
 }
 
 void SteamClient::LeaveChat(SteamID chat) {
-	// TODO: move this somwehre else
-	if (chat.type == static_cast<unsigned>(EAccountType::Clan)) {
-		// this is a ClanID - convert to its respective ChatID
-		chat.instance = static_cast<unsigned>(0x100000 >> 1); // TODO: this should be defined somewhere else
-		chat.type = static_cast<unsigned>(EAccountType::Chat);
-	}
+	chat = ChatID(chat);
 	
 	cmClient->WriteMessage(EMsg::ClientChatMemberInfo, sizeof(MsgClientChatMemberInfo) + 20, [&](unsigned char* buffer) {
 		auto leave_chat = new (buffer) MsgClientChatMemberInfo;
@@ -79,12 +217,7 @@ void SteamClient::LeaveChat(SteamID chat) {
 }
 
 void SteamClient::SendChatMessage(SteamID chat, const char* message) {
-	// TODO: move this somwehre else
-	if (chat.type == static_cast<unsigned>(EAccountType::Clan))	{
-		// this is a ClanID - convert to its respective ChatID
-		chat.instance = static_cast<unsigned>(0x100000 >> 1); // TODO: this should be defined somewhere else
-		chat.type = static_cast<unsigned>(EAccountType::Chat);
-	}
+	chat = ChatID(chat);
 	
 	cmClient->WriteMessage(EMsg::ClientChatMsg, sizeof(MsgClientChatMsg) + std::strlen(message) + 1, [&](unsigned char* buffer) {
 		auto send_msg = new (buffer) MsgClientChatMsg;
@@ -128,11 +261,167 @@ void SteamClient::RequestUserInfo(std::size_t count, SteamID users[]) {
 }
 
 
+void SteamClient::cork() {
+	cmClient->corked++;
+}
+
+void SteamClient::uncork() {
+	assert(cmClient->corked);
+	if (!--cmClient->corked) {
+		cmClient->Flush();
+	}
+}
+
+void SteamClient::offload(CryptoPool& pool, std::function<void(std::function<void()> callback)> post) {
+	assert(!cmClient->strand);
+	cmClient->pool = pool.impl;
+	cmClient->strand = std::make_shared<CryptoPool::Strand>();
+	cmClient->post = std::move(post);
+}
+
+Buffer SteamClient::pending() {
+	auto &queue = cmClient->queue;
+	if (queue.empty()) {
+		return { nullptr, 0 };
+	}
+	
+	auto &block = queue.front();
+	cmClient->inFlight = block.size() - cmClient->queueOffset;
+	return { block.data() + cmClient->queueOffset, cmClient->inFlight };
+}
+
+void SteamClient::sent(std::size_t length) {
+	if (cmClient->staleAcks) {
+		// still about the previous connection
+		auto stale = std::min(length, cmClient->staleAcks);
+		cmClient->staleAcks -= stale;
+		length -= stale;
+		if (!cmClient->staleAcks) {
+			cmClient->staleBlocks.clear();
+		}
+	}
+	
+	auto &queue = cmClient->queue;
+	if (!length || queue.empty()) {
+		assert(!length);
+		return;
+	}
+	
+	auto &block = queue.front();
+	cmClient->inFlight -= std::min(length, cmClient->inFlight);
+	cmClient->queueOffset += length;
+	cmClient->queued -= length;
+	assert(cmClient->queueOffset <= block.size());
+	
+	if (cmClient->queueOffset == block.size()) {
+		if (queue.size() == 1) {
+			// nothing else is queued, so keep the block around for the next packets
+			block.clear();
+		} else {
+			cmClient->spareBlock = std::move(block);
+			cmClient->spareBlock.clear();
+			queue.pop_front();
+		}
+		cmClient->queueOffset = 0;
+	}
+	
+	if (cmClient->backpressured && cmClient->queued < cmClient->lowWatermark) {
+		cmClient->backpressured = false;
+		listener->onWriteDrained();
+	}
+}
+
+void SteamClient::SetInflateLimit(std::size_t bytes) {
+	cmClient->arena.retain = bytes;
+	if (!cmClient->inflating) {
+		cmClient->arena.Trim();
+	}
+}
+
+std::size_t SteamClient::InflateMemory() const {
+	return cmClient->arena.Capacity();
+}
+
+google::protobuf::Message& SteamClient::NewMessage(EMsg emsg, const google::protobuf::Message& prototype, std::size_t length) {
+	return cmClient->NewMessage(emsg, prototype, length);
+}
+
+void SteamClient::SubscribeRaw(EMsg emsg, bool subscribe) {
+	auto index = static_cast<std::size_t>(emsg);
+	if (index >= cmClient->rawSubscriptions.size()) {
+		cmClient->rawSubscriptions.resize(index + 1);
+	}
+	cmClient->rawSubscriptions[index] = subscribe;
+}
+
+std::function<void(const MessageHeader& header, const unsigned char* data, std::size_t length)> SteamClient::RegisterHandler(
+	EMsg emsg,
+	std::function<void(const MessageHeader& header, const unsigned char* data, std::size_t length)> handler
+) {
+	auto& handlers = cmClient->handlers;
+	if (!handlers.Find(emsg)) {
+		// the page takes over from the built-in handlers for all of its EMsgs, not just this one
+		auto page_size = HandlerTable<CMClient::Handler>::PAGE_SIZE;
+		auto first = static_cast<std::size_t>(emsg) / page_size * page_size;
+		for (auto index = first; index < first + page_size; index++) {
+			auto builtin = FindBuiltinHandler(static_cast<EMsg>(index));
+			if (builtin) {
+				handlers[static_cast<EMsg>(index)] = [this, builtin](const MessageHeader& header, const unsigned char* data, std::size_t length) {
+					builtin(*this, header, data, length);
+				};
+			}
+		}
+	}
+	
+	auto& slot = handlers[emsg];
+	auto previous = std::move(slot);
+	slot = std::move(handler);
+	return previous;
+}
+
+std::uint64_t SteamClient::SendJob(
+	EMsg emsg,
+	const google::protobuf::Message& message,
+	std::function<void(EResult result, EMsg emsg, const MessageHeader& header, Buffer body)> callback,
+	unsigned timeout
+) {
+	auto job_id = cmClient->StartJob(std::move(callback), timeout);
+	cmClient->WriteMessage(emsg, message, 0, job_id);
+	return job_id;
+}
+
+bool SteamClient::CancelJob(std::uint64_t job_id) {
+	// its ID stays in the wheel until it comes round
+	return cmClient->pendingJobs.erase(job_id) > 0;
+}
+
 std::size_t SteamClient::connected() {
+	if (cmClient->strand) {
+		// anything still in flight belongs to the old connection and mustn't race with the new session key
+		cmClient->strand->Wait();
+		cmClient->strand->generation++;
+	}
+	
 	packetLength = 0;	
 	cmClient->steamID.ID = 0;
 	cmClient->sessionID = 0;
 	cmClient->encrypted = false;
+	cmClient->feedBuffer.clear();
+	cmClient->corkBuffer.clear();
+	if (cmClient->inFlight) {
+		// the transport has yet to tell us it's done with this, so it has to stay put
+		cmClient->staleBlocks.push_back(std::move(cmClient->queue.front()));
+		cmClient->staleAcks += cmClient->inFlight;
+		cmClient->inFlight = 0;
+	}
+	cmClient->queue.clear();
+	cmClient->queueOffset = 0;
+	cmClient->queued = 0;
+	if (cmClient->backpressured) {
+		// nothing's left to wait for, don't leave the application throttled
+		cmClient->backpressured = false;
+		listener->onWriteDrained();
+	}
 	
 	return 8;
 }
@@ -144,54 +433,173 @@ std::size_t SteamClient::readable(const unsigned char* input) {
 		return packetLength;
 	}
 	
-	if (cmClient->encrypted) {
-		byte iv[16];
-		ECB_Mode<AES>::Decryption(cmClient->sessionKey, sizeof(cmClient->sessionKey)).ProcessData(iv, input, 16);
+	ReadPacket(input, packetLength);
+	
+	packetLength = 0;
+	return 8;
+}
+
+std::size_t SteamClient::feed(const unsigned char* buffer, std::size_t length) {
+	auto &partial = cmClient->feedBuffer;
+	std::size_t packets = 0;
+	
+	while (length) {
+		if (partial.empty() && length >= 8) {
+			// the whole packet might be right here, in which case there's no need to copy it
+			auto packet_length = *reinterpret_cast<const std::uint32_t*>(buffer);
+			assert(std::equal(MAGIC, MAGIC + 4, buffer + 4));
+			if (length - 8 >= packet_length) {
+				ReadPacket(buffer + 8, packet_length);
+				buffer += 8 + packet_length;
+				length -= 8 + packet_length;
+				packets++;
+				continue;
+			}
+		}
 		
-		auto crypted_data = input + 16;
-		CBC_Mode<AES>::Decryption d(cmClient->sessionKey, sizeof(cmClient->sessionKey), iv);
-		// I don't see any way to get the decrypted size other than to use a string
-		std::string output;
-		ArraySource(
-			crypted_data,
-			packetLength - 16,
-			true,
-			new StreamTransformationFilter(d, new StringSink(output))
-		);
+		// otherwise stash the bytes until the rest of the packet arrives
+		std::size_t expected = 8;
+		if (partial.size() >= 8)
+			expected += *reinterpret_cast<const std::uint32_t*>(partial.data());
 		
-		ReadMessage(reinterpret_cast<const unsigned char*>(output.data()), output.length());
-	} else {
-		ReadMessage(input, packetLength);
+		auto chunk = std::min(expected - partial.size(), length);
+		partial.insert(partial.end(), buffer, buffer + chunk);
+		buffer += chunk;
+		length -= chunk;
+		
+		// the header may have just been completed, and the packet with it if it's empty
+		if (partial.size() == 8)
+			expected += *reinterpret_cast<const std::uint32_t*>(partial.data());
+		
+		if (partial.size() >= 8 && partial.size() == expected) {
+			assert(std::equal(MAGIC, MAGIC + 4, partial.data() + 4));
+			ReadPacket(partial.data() + 8, expected - 8);
+			partial.clear(); // keeps the capacity for the next one
+			packets++;
+		}
 	}
 	
-	packetLength = 0;
-	return 8;
+	return packets;
+}
+
+void SteamClient::ReadPacket(const unsigned char* input, std::size_t length) {
+	if (cmClient->encrypted && cmClient->strand) {
+		// the caller's buffer won't live long enough, so decrypt a copy in place on a worker
+		auto job = cmClient->NewJob(length);
+		std::copy(input, input + length, job->begin());
+		
+		auto strand = cmClient->strand;
+		auto generation = strand->generation;
+		cmClient->pool->Submit(strand, [this, job, strand, generation] {
+			auto plaintext = job->data() + 16;
+			auto plaintext_length = cmClient->DecryptPacket(job->data(), job->size(), plaintext);
+			
+			cmClient->post([this, job, strand, generation, plaintext, plaintext_length] {
+				if (strand->closed) {
+					delete job;
+					return;
+				}
+				
+				if (strand->generation == generation && plaintext_length) {
+					ReadMessage(plaintext, plaintext_length);
+				}
+				
+				cmClient->spareJobs.push_back(job);
+			});
+		});
+	} else if (cmClient->encrypted) {
+		// decrypt into a buffer that outlives the packet so that we don't allocate every time
+		// a corrupt packet is dropped
+		auto &output = cmClient->readBuffer;
+		if (output.size() < length)
+			output.resize(length);
+		
+		auto plaintext_length = cmClient->DecryptPacket(input, length, output.data());
+		if (plaintext_length) {
+			ReadMessage(output.data(), plaintext_length);
+		}
+	} else {
+		ReadMessage(input, length);
+	}
 }
 
 void SteamClient::ReadMessage(const unsigned char* data, std::size_t length) {
+	// anything too short for its header can't be handled, so it's dropped
+	if (length < 4) {
+		return;
+	}
+	
 	auto raw_emsg = *reinterpret_cast<const std::uint32_t*>(data);
 	auto emsg = static_cast<EMsg>(raw_emsg & ~PROTO_MASK);
 	
 	// first figure out the header type
+	MessageHeader info = {};
+	
 	if (emsg == EMsg::ChannelEncryptRequest || emsg == EMsg::ChannelEncryptResult) {
+		if (length < sizeof(MsgHdr)) {
+			return;
+		}
+		
 		auto header = reinterpret_cast<const MsgHdr*>(data);
-		HandleMessage(emsg, data + sizeof(MsgHdr), length - sizeof(MsgHdr), header->sourceJobID);
+		info.sourceJobID = header->sourceJobID;
+		info.targetJobID = header->targetJobID;
+		HandleMessage(emsg, info, data + sizeof(MsgHdr), length - sizeof(MsgHdr));
 	} else if (raw_emsg & PROTO_MASK) {
 		auto header = reinterpret_cast<const MsgHdrProtoBuf*>(data);
-		CMsgProtoBufHeader proto;
-		proto.ParseFromArray(header->proto, header->headerLength);
+		if (length < sizeof(MsgHdrProtoBuf) || header->headerLength < 0 || length - sizeof(MsgHdrProtoBuf) < static_cast<std::size_t>(header->headerLength)) {
+			return;
+		}
+		
+		info.protobuf = true;
+		info.proto = Buffer { header->proto, static_cast<std::size_t>(header->headerLength) };
+		
+		// we only need a few fields, so pick them out instead of parsing the whole header
+		info.sourceJobID = CMsgProtoBufHeader::default_instance().jobid_source();
+		info.targetJobID = CMsgProtoBufHeader::default_instance().jobid_target();
+		
+		WireReader reader(header->proto, header->headerLength);
+		WireField field;
+		while (reader.Next(field)) {
+			switch (field.number) {
+			case CMsgProtoBufHeader::kSteamidFieldNumber:
+				info.steamID = field.value;
+				break;
+				
+			case CMsgProtoBufHeader::kClientSessionidFieldNumber:
+				info.sessionID = static_cast<std::int32_t>(field.value);
+				break;
+				
+			case CMsgProtoBufHeader::kJobidSourceFieldNumber:
+				info.sourceJobID = field.value;
+				break;
+				
+			case CMsgProtoBufHeader::kJobidTargetFieldNumber:
+				info.targetJobID = field.value;
+				break;
+			}
+		}
+		assert(!reader.Failed());
+		
 		if (!cmClient->sessionID && header->headerLength > 0) {
-			cmClient->sessionID = proto.client_sessionid();
-			cmClient->steamID = proto.steamid();
+			cmClient->sessionID = info.sessionID;
+			cmClient->steamID = info.steamID;
 		}
 		HandleMessage(
 			emsg,
+			info,
 			data + sizeof(MsgHdrProtoBuf) + header->headerLength,
-			length - sizeof(MsgHdrProtoBuf) - header->headerLength,
-			proto.jobid_source()
+			length - sizeof(MsgHdrProtoBuf) - header->headerLength
 		);
 	} else {
+		if (length < sizeof(ExtendedClientMsgHdr)) {
+			return;
+		}
+		
 		auto header = reinterpret_cast<const ExtendedClientMsgHdr*>(data);
-		HandleMessage(emsg, data + sizeof(ExtendedClientMsgHdr), length - sizeof(ExtendedClientMsgHdr), header->sourceJobID);
+		info.steamID = header->steamID;
+		info.sessionID = header->sessionID;
+		info.sourceJobID = header->sourceJobID;
+		info.targetJobID = header->targetJobID;
+		HandleMessage(emsg, info, data + sizeof(ExtendedClientMsgHdr), length - sizeof(ExtendedClientMsgHdr));
 	}
 }
@@ -1,7 +1,14 @@
 #include <functional>
 #include <map>
+#include <type_traits>
 #include "steam_language/steam_language.h"
 
+namespace google {
+	namespace protobuf {
+		class Message;
+	}
+}
+
 namespace Steam {
 	const struct {
 		const char* host;
@@ -112,16 +119,91 @@ namespace Steam {
 	};
 #pragma pack(pop)
 	
+	/**
+	 * A piece of a packet, same idea as @c iovec or @c WSABUF.
+	 */
+	struct Buffer {
+		const unsigned char* data;
+		std::size_t length;
+	};
+	
+	/**
+	 * What the header of an incoming message says. Fields its header type doesn't have are 0.
+	 */
+	struct MessageHeader {
+		bool protobuf;
+		SteamID steamID;
+		std::int32_t sessionID;
+		std::uint64_t sourceJobID;
+		std::uint64_t targetJobID;
+		
+		/**
+		 * The serialized CMsgProtoBufHeader if #protobuf, parse it yourself if you need any other field.
+		 */
+		Buffer proto;
+	};
+	
+	/**
+	 * Worker threads that SteamClients can hand their encryption and decryption to, see SteamClient#offload.
+	 * One pool can be shared by any number of clients, but it must outlive all of them.
+	 */
+	class CryptoPool {
+	public:
+		CryptoPool(unsigned threads);
+		~CryptoPool();
+		
+	private:
+		friend class SteamClient;
+		class Impl;
+		struct Strand;
+		Impl* impl;
+	};
+	
 	class SteamClient {
 	public:
+		class Listener;
+		
 		/**
 		 * @param write         Called when SteamClient wants to send some data over the socket.
 		 *                      Allocate a buffer of @a length bytes, then call @a fill with it, then send it.
 		 * @param set_interval  @a callback must be called every @a timeout seconds as long as the connection is alive.
+		 * @param listener      Optional, receives the events instead of the @c on* members. Must outlive the SteamClient.
 		 */
 		SteamClient(
 			std::function<void(std::size_t length, std::function<void(unsigned char* buffer)> fill)> write,
-			std::function<void(std::function<void()> callback, int timeout)> set_interval
+			std::function<void(std::function<void()> callback, int timeout)> set_interval,
+			Listener* listener = nullptr
+		);
+		
+		/**
+		 * @param writev        Called when SteamClient wants to send some data over the socket.
+		 *                      Send the @a count @a buffers in order as one packet, e.g. with @c writev.
+		 *                      They are only valid until @a writev returns.
+		 * @param set_interval  Same as above.
+		 * @param listener      Same as above.
+		 */
+		SteamClient(
+			std::function<void(const Buffer buffers[], std::size_t count)> writev,
+			std::function<void(std::function<void()> callback, int timeout)> set_interval,
+			Listener* listener = nullptr
+		);
+		
+		/**
+		 * Queued mode: packets are kept in SteamClient until you pull them with #pending and #sent.
+		 * 
+		 * @param want_write      Called when there is something to send after the queue has been empty.
+		 *                        Wait until the socket is writable, then call #pending and #sent until it's empty again.
+		 * @param set_interval    Same as above.
+		 * @param high_watermark  #onWriteBackpressure is called when more than this many bytes are queued.
+		 * @param low_watermark   #onWriteDrained is called when the queue shrinks below this many bytes afterwards.
+		 * @param listener        Same as above.
+		 */
+		SteamClient(
+			std::function<void()> want_write,
+			std::function<void(std::function<void()> callback, int timeout)> set_interval,
+			std::size_t high_watermark = 256 * 1024,
+			std::size_t low_watermark = 64 * 1024,
+			Listener* listener = nullptr
 		);
 		
 		~SteamClient();
@@ -129,6 +211,8 @@ namespace Steam {
 		
 		/**
 		 * Call when a connection has been established.
+		 * In queued mode this drops whatever the old connection left queued, and calls #onWriteDrained
+		 * if it was backpressured.
 		 * 
 		 * @return The number of bytes SteamClient expects next.
 		 */
@@ -142,6 +226,124 @@ namespace Steam {
 		 */
 		std::size_t readable(const unsigned char* buffer);
 		
+		/**
+		 * Alternative to #readable: call with whatever the socket returned, after calling #connected.
+		 * Every complete packet in @a buffer is handled right away and any incomplete one is kept
+		 * until the rest of it arrives, so all @a length bytes are always consumed.
+		 * Don't mix with #readable on the same connection.
+		 * 
+		 * @return The number of packets handled.
+		 */
+		std::size_t feed(const unsigned char* buffer, std::size_t length);
+		
+		/**
+		 * Until the matching #uncork, outgoing packets are collected in one buffer instead of being written right away.
+		 * Use it around a batch of calls to send them with a single write. Can be nested.
+		 * Has no effect in queued mode, where #pending coalesces packets anyway, nor on packets encrypted
+		 * through #offload, which are written once the worker is done with them.
+		 */
+		void cork();
+		
+		/**
+		 * Writes everything collected since the outermost #cork at once.
+		 */
+		void uncork();
+		
+		/**
+		 * Moves encryption and decryption of this client's packets to @a pool. Call before #connected.
+		 * Incoming messages are still handled and outgoing packets still written in order, but only once
+		 * the respective callback passed to @a post is called.
+		 * 
+		 * @param post  Called from a worker thread. Must call @a callback on the thread you use this SteamClient on,
+		 *              in the same order as they were posted.
+		 */
+		void offload(CryptoPool& pool, std::function<void(std::function<void()> callback)> post);
+		
+		/**
+		 * Queued mode only. The returned data stays valid until you pass its length to #sent,
+		 * even if more packets are queued in the meantime.
+		 * 
+		 * @return The next bytes to send, or an empty Buffer if the queue is empty.
+		 */
+		Buffer pending();
+		
+		/**
+		 * Queued mode only. Call when the first @a length bytes of what #pending returned have been sent.
+		 * That includes whatever it returned before a reconnect: it stays valid until the write completes,
+		 * so report it as sent even if the old connection failed.
+		 */
+		void sent(std::size_t length);
+		
+		/**
+		 * Compressed messages are inflated into memory that's kept around for the next ones.
+		 * Once a burst has been handled, anything held beyond @a bytes is freed. Defaults to 256 KB.
+		 */
+		void SetInflateLimit(std::size_t bytes);
+		
+		/**
+		 * @return How much memory is currently held for inflating compressed messages.
+		 */
+		std::size_t InflateMemory() const;
+		
+		
+		/**
+		 * Alternative to the @c on* members: each event costs one virtual call and there are no captures to allocate.
+		 * Override the events you want, they're documented with their namesakes below.
+		 */
+		class Listener {
+		public:
+			virtual ~Listener() {}
+			
+			virtual void onWriteBackpressure() {}
+			virtual void onWriteDrained() {}
+			virtual void onHandshake() {}
+			virtual void onLogOn(EResult result, SteamID steamID) {}
+			virtual void onLogOff(EResult result) {}
+			virtual void onSentry(const unsigned char hash[20]) {}
+			virtual void onUserInfo(
+				SteamID user,
+				SteamID* source,
+				const char* name,
+				EPersonaState* state,
+				const unsigned char avatar_hash[20],
+				const char* game_name
+			) {}
+			virtual void onChatEnter(
+				SteamID room,
+				EChatRoomEnterResponse response,
+				const char* name,
+				std::size_t member_count,
+				const ChatMember members[]
+			) {}
+			virtual void onChatStateChange(
+				SteamID room,
+				SteamID acted_by,
+				SteamID acted_on,
+				EChatMemberStateChange state_change,
+				const ChatMember* member
+			) {}
+			virtual void onChatMsg(SteamID room, SteamID chatter, const char* message) {}
+			virtual void onPrivateMsg(SteamID user, const char* message) {}
+			virtual void onTyping(SteamID user) {}
+			virtual void onRelationships(
+				bool incremental,
+				std::map<SteamID, EFriendRelationship> &users,
+				std::map<SteamID, EClanRelationship> &groups
+			) {}
+			virtual void onRawMessage(EMsg emsg, const MessageHeader& header, Buffer body) {}
+		};
+		
+		/**
+		 * Queued mode only. The queue has grown past the high watermark – stop sending until #onWriteDrained.
+		 * Nothing is ever dropped, so it's up to you to throttle.
+		 */
+		std::function<void()> onWriteBackpressure;
+		
+		/**
+		 * Queued mode only. The queue has shrunk below the low watermark after #onWriteBackpressure,
+		 * or #connected dropped it.
+		 */
+		std::function<void()> onWriteDrained;
 		
 		/**
 		 * Encryption handshake complete – it's now safe to log on.
@@ -203,6 +405,12 @@ namespace Steam {
 			std::map<SteamID, EClanRelationship> &groups
 		)> onRelationships;
 		
+		/**
+		 * Called with every message SteamClient doesn't handle itself, and with those passed to #SubscribeRaw.
+		 * Nothing is parsed. @a body is only valid until this returns, so copy it if you want to parse it elsewhere.
+		 */
+		std::function<void(EMsg emsg, const MessageHeader& header, Buffer body)> onRawMessage;
+		
 		
 		/**
 		 * Call this after the encryption handshake. @a steamID is only needed if you are logging into a non-default instance.
@@ -219,6 +427,12 @@ namespace Steam {
 		
 		void SetPersonaState(EPersonaState state);
 		
+		/**
+		 * The chat that #JoinChat, #LeaveChat and #SendChatMessage use for @a chat, which is the clan's chat
+		 * if @a chat is a clan. It's what #onChatEnter and the other chat events report.
+		 */
+		static SteamID ChatID(SteamID chat);
+		
 		/**
 		 * @see onChatEnter
 		 */
@@ -237,14 +451,94 @@ namespace Steam {
 		 */
 		void RequestUserInfo(std::size_t count, SteamID users[]);
 		
+		/**
+		 * Also pass @a emsg to #onRawMessage even though SteamClient handles it, before it does.
+		 */
+		void SubscribeRaw(EMsg emsg, bool subscribe = true);
+		
+		/**
+		 * Handles @a emsg with @a handler instead of whatever handled it before, SteamClient's own handlers included.
+		 * An empty @a handler leaves @a emsg to #onRawMessage. Don't replace a handler from inside itself.
+		 * 
+		 * @param handler  @a data is the message body and is only valid until @a handler returns.
+		 * @return The previous handler, so that yours can call it.
+		 */
+		std::function<void(const MessageHeader& header, const unsigned char* data, std::size_t length)> RegisterHandler(
+			EMsg emsg,
+			std::function<void(const MessageHeader& header, const unsigned char* data, std::size_t length)> handler
+		);
+		
+		/**
+		 * Like #RegisterHandler, but @a handler is passed the parsed body. Include steam++_messages.h to use this.
+		 * 
+		 * @param handler  If MessageType<emsg> is a protobuf message, called with <tt>(const MessageHeader&, const Message&)</tt>.
+		 *                 If it's a struct, called with <tt>(const MessageHeader&, const Struct&, const unsigned char* payload, std::size_t length)</tt>
+		 *                 where @a payload is whatever follows the struct. Bodies too short for the struct are dropped.
+		 *                 Either way it's only valid until @a handler returns.
+		 */
+		template <EMsg emsg, typename Handler>
+		void on(Handler handler);
+		
+		/**
+		 * Sends @a message with a new job ID and calls @a callback with the response to it instead of passing
+		 * that to its handler, so any number of requests can be outstanding at once. Jobs still outstanding
+		 * when the SteamClient is destroyed are dropped without a call.
+		 * 
+		 * @param callback  @a result is EResult::OK with the response, or EResult::Timeout with an empty
+		 *                  @a header and @a body if none arrived within @a timeout seconds.
+		 *                  @a body is only valid until @a callback returns.
+		 * @param timeout   Checked on every heartbeat, so it's only as precise as the interval passed to
+		 *                  @c set_interval, and not at all before #onLogOn.
+		 * @return The job ID, for #CancelJob.
+		 */
+		std::uint64_t SendJob(
+			EMsg emsg,
+			const google::protobuf::Message& message,
+			std::function<void(EResult result, EMsg emsg, const MessageHeader& header, Buffer body)> callback,
+			unsigned timeout = 30
+		);
+		
+		/**
+		 * Forgets about a job without calling its callback. A response that still arrives goes to its handler.
+		 * 
+		 * @return Whether the job was still outstanding.
+		 */
+		bool CancelJob(std::uint64_t job_id);
+		
 	private:
+		friend struct SteamClientBench; // steam++_bench.cpp
+		
 		class CMClient;
 		CMClient* cmClient;
 		
+		// the Listener the constructor was given, or callbacks
+		Listener* listener;
+		class Callbacks;
+		Callbacks* callbacks; // forwards to the on* members
+		
+		// with the on* members, messages nobody listens to needn't be parsed
+		template <typename Callback>
+		bool Listening(const Callback& callback) const {
+			return !callbacks || static_cast<bool>(callback);
+		}
+		
 		// some members remain here to avoid a back pointer
 		std::function<void(std::function<void()> callback, int timeout)> setInterval;
 		std::size_t packetLength;
+		void ReadPacket(const unsigned char* data, std::size_t length);
 		void ReadMessage(const unsigned char* data, std::size_t length);
-		void HandleMessage(EMsg eMsg, const unsigned char* data, std::size_t length, std::uint64_t job_id);
+		google::protobuf::Message& NewMessage(EMsg emsg, const google::protobuf::Message& prototype, std::size_t length);
+		// parses a body of @a emsg's MessageType and calls @a handler like #on does, used by the built-in handlers too
+		template <EMsg emsg, typename Handler>
+		void Parse(const MessageHeader& header, const unsigned char* data, std::size_t length, Handler&& handler);
+		template <typename Message, typename Handler>
+		void ParseMessage(EMsg emsg, const MessageHeader& header, const unsigned char* data, std::size_t length, Handler& handler, std::true_type protobuf);
+		template <typename Message, typename Handler>
+		void ParseMessage(EMsg emsg, const MessageHeader& header, const unsigned char* data, std::size_t length, Handler& handler, std::false_type protobuf);
+		void HandleMessage(EMsg eMsg, const MessageHeader& header, const unsigned char* data, std::size_t length);
+		
+		// SteamClient's own handlers, built once and shared by every client
+		typedef void (*BuiltinHandler)(SteamClient& client, const MessageHeader& header, const unsigned char* data, std::size_t length);
+		static BuiltinHandler FindBuiltinHandler(EMsg emsg);
 	};
 }
@@ -0,0 +1,656 @@
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <zlib.h>
+
+#include "cmclient.h"
+
+// count every heap allocation so that benchmarks can report allocs/op
+
+static std::atomic<std::size_t> allocations(0);
+
+void* operator new(std::size_t size) {
+	allocations++;
+	if (auto p = std::malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept {
+	std::free(p);
+}
+
+void operator delete(void* p, std::size_t) noexcept {
+	std::free(p);
+}
+
+namespace Steam {
+	// befriended in steam++.h
+	struct SteamClientBench {
+		typedef SteamClient::CMClient CMClient;
+		
+		static CMClient& cmClient(SteamClient& client) {
+			return *client.cmClient;
+		}
+		
+		static void ReadMessage(SteamClient& client, const unsigned char* data, std::size_t length) {
+			client.ReadMessage(data, length);
+		}
+	};
+}
+
+typedef SteamClientBench::CMClient CMClient;
+
+namespace {
+	// measures allocations made between construction and Report
+	class AllocationCounter {
+	public:
+		AllocationCounter() : start(allocations) {}
+		
+		void Report(benchmark::State& state) {
+			state.counters["allocs/op"] = benchmark::Counter(
+				static_cast<double>(allocations - start),
+				benchmark::Counter::kAvgIterations
+			);
+		}
+	
+	private:
+		std::size_t start;
+	};
+	
+	// swallows everything SteamClient writes
+	std::vector<unsigned char> sink(1 << 20);
+	
+	CMClient& Encrypt(SteamClient& client) {
+		auto &cmClient = SteamClientBench::cmClient(client);
+		
+		// both ends need the same key, the IV generator can be seeded with anything
+		std::fill(cmClient.sessionKey, cmClient.sessionKey + sizeof(cmClient.sessionKey), 0x42);
+		byte seed[32 + 16] = {};
+		cmClient.rnd.SetKeyWithIV(seed, 32, seed + 32);
+		cmClient.EnableEncryption();
+		
+		return cmClient;
+	}
+	
+	struct Client {
+		Client(bool encrypted = false, SteamClient::Listener* listener = nullptr) : client(
+			[](std::size_t length, std::function<void(unsigned char* buffer)> fill) {
+				assert(length <= sink.size());
+				fill(sink.data());
+			},
+			[](std::function<void()> callback, int timeout) {},
+			listener
+		) {
+			client.connected();
+			if (encrypted)
+				Encrypt(client);
+		}
+		
+		SteamClient client;
+	};
+	
+	// runs @a send on a client with its own key and returns the packet it wrote
+	std::string Packet(bool encrypted, const std::function<void(CMClient& cmClient)> &send) {
+		std::string packet;
+		SteamClient server(
+			[&packet](std::size_t length, std::function<void(unsigned char* buffer)> fill) {
+				packet.resize(length);
+				fill(reinterpret_cast<unsigned char*>(&packet[0]));
+			},
+			[](std::function<void()> callback, int timeout) {}
+		);
+		server.connected();
+		
+		auto &cmClient = encrypted ? Encrypt(server) : SteamClientBench::cmClient(server);
+		send(cmClient);
+		return packet;
+	}
+	
+	// the message as ReadMessage sees it, i.e. a packet without the length and magic
+	std::string Message(EMsg emsg, const google::protobuf::Message &message) {
+		return Packet(false, [&](CMClient& cmClient) {
+			cmClient.WriteMessage(emsg, message);
+		}).substr(8);
+	}
+	
+	std::string Message(EMsg emsg, const std::string &body) {
+		return Packet(false, [&](CMClient& cmClient) {
+			cmClient.WriteMessage(emsg, body.size(), [&body](unsigned char* buffer) {
+				std::copy(body.begin(), body.end(), buffer);
+			});
+		}).substr(8);
+	}
+	
+	template<class T>
+	std::string Struct(const T &header, const std::string &payload = "") {
+		return std::string(reinterpret_cast<const char*>(&header), sizeof(header)) + payload;
+	}
+	
+	std::string FriendMsg(std::size_t length) {
+		CMsgClientFriendMsgIncoming msg;
+		msg.set_steamid_from(76561197960287930);
+		msg.set_chat_entry_type(static_cast<google::protobuf::uint32>(EChatEntryType::ChatMsg));
+		msg.set_message(std::string(length, 'a'));
+		return Message(EMsg::ClientFriendMsgIncoming, msg);
+	}
+	
+	void AppendUInt(std::string &out, std::uint32_t value, int size) {
+		while (size--) {
+			out += static_cast<char>(value & 0xFF);
+			value >>= 8;
+		}
+	}
+	
+	// a single-entry PKZIP archive the way Valve makes them
+	std::string Zip(const std::string &data) {
+		z_stream stream = {};
+		deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY);
+		std::string deflated(deflateBound(&stream, data.size()), '\0');
+		stream.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+		stream.avail_in = data.size();
+		stream.next_out = reinterpret_cast<Bytef*>(&deflated[0]);
+		stream.avail_out = deflated.size();
+		deflate(&stream, Z_FINISH);
+		deflated.resize(stream.total_out);
+		deflateEnd(&stream);
+		
+		auto crc = crc32(0, reinterpret_cast<const Bytef*>(data.data()), data.size());
+		
+		std::string zip;
+		AppendUInt(zip, 0x04034B50, 4); // local file header
+		AppendUInt(zip, 20, 2); // version needed
+		AppendUInt(zip, 0, 2); // flags
+		AppendUInt(zip, 8, 2); // deflate
+		AppendUInt(zip, 0, 4); // time and date
+		AppendUInt(zip, crc, 4);
+		AppendUInt(zip, deflated.size(), 4);
+		AppendUInt(zip, data.size(), 4);
+		AppendUInt(zip, 1, 2); // name length
+		AppendUInt(zip, 0, 2); // extra length
+		zip += 'z';
+		zip += deflated;
+		
+		auto directory_offset = zip.size();
+		AppendUInt(zip, 0x02014B50, 4); // central directory header
+		AppendUInt(zip, 20, 2); // version made by
+		AppendUInt(zip, 20, 2); // version needed
+		AppendUInt(zip, 0, 2); // flags
+		AppendUInt(zip, 8, 2); // deflate
+		AppendUInt(zip, 0, 4); // time and date
+		AppendUInt(zip, crc, 4);
+		AppendUInt(zip, deflated.size(), 4);
+		AppendUInt(zip, data.size(), 4);
+		AppendUInt(zip, 1, 2); // name length
+		AppendUInt(zip, 0, 2); // extra length
+		AppendUInt(zip, 0, 2); // comment length
+		AppendUInt(zip, 0, 2); // disk number
+		AppendUInt(zip, 0, 2); // internal attributes
+		AppendUInt(zip, 0, 4); // external attributes
+		AppendUInt(zip, 0, 4); // local header offset
+		zip += 'z';
+		
+		auto directory_size = zip.size() - directory_offset;
+		AppendUInt(zip, 0x06054B50, 4); // end of central directory
+		AppendUInt(zip, 0, 2); // disk number
+		AppendUInt(zip, 0, 2); // disk with the directory
+		AppendUInt(zip, 1, 2); // entries on this disk
+		AppendUInt(zip, 1, 2); // entries
+		AppendUInt(zip, directory_size, 4);
+		AppendUInt(zip, directory_offset, 4);
+		AppendUInt(zip, 0, 2); // comment length
+		
+		return zip;
+	}
+	
+	std::string Multi(std::size_t count, bool compressed) {
+		std::string payload;
+		auto message = FriendMsg(64);
+		while (count--) {
+			AppendUInt(payload, message.size(), 4);
+			payload += message;
+		}
+		
+		CMsgMulti multi;
+		if (compressed) {
+			multi.set_size_unzipped(payload.size());
+			multi.set_message_body(Zip(payload));
+		} else {
+			multi.set_message_body(payload);
+		}
+		return Message(EMsg::Multi, multi);
+	}
+	
+	std::string Handled(EMsg emsg) {
+		switch (emsg) {
+		case EMsg::ChannelEncryptRequest:
+			{
+				MsgHdr header;
+				header.msg = static_cast<std::uint32_t>(emsg);
+				MsgChannelEncryptRequest request;
+				request.universe = static_cast<std::uint32_t>(EUniverse::Public);
+				return Struct(header, Struct(request));
+			}
+		
+		case EMsg::ChannelEncryptResult:
+			{
+				MsgHdr header;
+				header.msg = static_cast<std::uint32_t>(emsg);
+				MsgChannelEncryptResult result;
+				result.result = static_cast<std::uint32_t>(EResult::OK);
+				return Struct(header, Struct(result));
+			}
+		
+		case EMsg::Multi:
+			return Multi(16, true);
+		
+		case EMsg::ClientLogOnResponse:
+			{
+				CMsgClientLogonResponse response;
+				response.set_eresult(static_cast<google::protobuf::int32>(EResult::OK));
+				response.set_out_of_game_heartbeat_seconds(9);
+				return Message(emsg, response);
+			}
+		
+		case EMsg::ClientLoggedOff:
+			{
+				CMsgClientLoggedOff logged_off;
+				logged_off.set_eresult(static_cast<google::protobuf::int32>(EResult::LoggedInElsewhere));
+				return Message(emsg, logged_off);
+			}
+		
+		case EMsg::ClientUpdateMachineAuth:
+			{
+				CMsgClientUpdateMachineAuth machine_auth;
+				machine_auth.set_bytes(std::string(2048, 's'));
+				return Message(emsg, machine_auth);
+			}
+		
+		case EMsg::ClientPersonaState:
+			{
+				CMsgClientPersonaState state;
+				for (auto i = 0; i < 100; i++) {
+					auto user = state.add_friends();
+					user->set_friendid(76561197960287930 + i);
+					user->set_persona_state(static_cast<google::protobuf::uint32>(EPersonaState::Online));
+					user->set_player_name("player " + std::to_string(i));
+					user->set_avatar_hash(std::string(20, 'h'));
+					user->set_game_name("Team Fortress 2");
+				}
+				return Message(emsg, state);
+			}
+		
+		case EMsg::ClientChatMsg:
+			{
+				MsgClientChatMsg msg;
+				msg.chatMsgType = static_cast<std::uint32_t>(EChatEntryType::ChatMsg);
+				return Message(emsg, Struct(msg, std::string(64, 'a') + '\0'));
+			}
+		
+		case EMsg::ClientChatEnter:
+			{
+				MsgClientChatEnter enter;
+				enter.enterResponse = static_cast<std::uint32_t>(EChatRoomEnterResponse::Success);
+				std::string payload;
+				AppendUInt(payload, 0, 4); // no members
+				payload += std::string("room") + '\0';
+				return Message(emsg, Struct(enter, payload));
+			}
+		
+		case EMsg::ClientChatMemberInfo:
+			{
+				MsgClientChatMemberInfo info;
+				info.type = static_cast<std::uint32_t>(EChatInfoType::StateChange);
+				std::string payload(8 + 4 + 8 + sizeof(ChatMember), '\0');
+				*reinterpret_cast<EChatMemberStateChange*>(&payload[8]) = EChatMemberStateChange::Left;
+				return Message(emsg, Struct(info, payload));
+			}
+		
+		case EMsg::ClientFriendsList:
+			{
+				CMsgClientFriendsList list;
+				for (auto i = 0; i < 250; i++) {
+					auto relationship = list.add_friends();
+					relationship->set_ulfriendid(76561197960287930 + i);
+					relationship->set_efriendrelationship(static_cast<google::protobuf::uint32>(EFriendRelationship::Friend));
+				}
+				return Message(emsg, list);
+			}
+		
+		case EMsg::ClientFriendMsgIncoming:
+			return FriendMsg(64);
+		
+		default:
+			assert(!"Not handled!");
+			return "";
+		}
+	}
+	
+	void SetListeners(SteamClient &client) {
+		client.onHandshake = [] {};
+		client.onLogOn = [](EResult result, SteamID steamID) {};
+		client.onLogOff = [](EResult result) {};
+		client.onSentry = [](const unsigned char hash[20]) {};
+		client.onUserInfo = [](SteamID user, SteamID* source, const char* name, EPersonaState* state, const unsigned char avatar_hash[20], const char* game_name) {};
+		client.onChatEnter = [](SteamID room, EChatRoomEnterResponse response, const char* name, std::size_t member_count, const ChatMember members[]) {};
+		client.onChatStateChange = [](SteamID room, SteamID acted_by, SteamID acted_on, EChatMemberStateChange state_change, const ChatMember* member) {};
+		client.onChatMsg = [](SteamID room, SteamID chatter, const char* message) {};
+		client.onPrivateMsg = [](SteamID user, const char* message) {};
+		client.onTyping = [](SteamID user) {};
+		client.onRelationships = [](bool incremental, std::map<SteamID, EFriendRelationship> &users, std::map<SteamID, EClanRelationship> &groups) {};
+	}
+}
+
+
+// inbound
+
+static void BM_Readable(benchmark::State& state, bool encrypted) {
+	Client client(encrypted);
+	client.client.onPrivateMsg = [](SteamID user, const char* message) {};
+	
+	auto packet = Packet(encrypted, [&](CMClient& cmClient) {
+		CMsgClientFriendMsgIncoming msg;
+		msg.set_message(std::string(state.range(0), 'a'));
+		msg.set_chat_entry_type(static_cast<google::protobuf::uint32>(EChatEntryType::ChatMsg));
+		cmClient.WriteMessage(EMsg::ClientFriendMsgIncoming, msg);
+	});
+	auto data = reinterpret_cast<const unsigned char*>(packet.data());
+	
+	AllocationCounter counter;
+	for (auto _ : state) {
+		client.client.readable(data);
+		client.client.readable(data + 8);
+	}
+	counter.Report(state);
+	state.SetBytesProcessed(state.iterations() * packet.size());
+}
+BENCHMARK_CAPTURE(BM_Readable, plaintext, false)->Range(16, 64 << 10);
+BENCHMARK_CAPTURE(BM_Readable, encrypted, true)->Range(16, 64 << 10);
+
+static void BM_Feed(benchmark::State& state, bool encrypted) {
+	Client client(encrypted);
+	client.client.onPrivateMsg = [](SteamID user, const char* message) {};
+	
+	auto packet = Packet(encrypted, [](CMClient& cmClient) {
+		CMsgClientFriendMsgIncoming msg;
+		msg.set_message(std::string(64, 'a'));
+		msg.set_chat_entry_type(static_cast<google::protobuf::uint32>(EChatEntryType::ChatMsg));
+		cmClient.WriteMessage(EMsg::ClientFriendMsgIncoming, msg);
+	});
+	
+	// a burst of packets, delivered in reads of state.range(0) bytes
+	std::string burst;
+	for (auto i = 0; i < 64; i++)
+		burst += packet;
+	auto data = reinterpret_cast<const unsigned char*>(burst.data());
+	std::size_t chunk = state.range(0);
+	
+	AllocationCounter counter;
+	for (auto _ : state) {
+		for (std::size_t offset = 0; offset < burst.size(); offset += chunk) {
+			client.client.feed(data + offset, std::min(chunk, burst.size() - offset));
+		}
+	}
+	counter.Report(state);
+	state.SetBytesProcessed(state.iterations() * burst.size());
+}
+BENCHMARK_CAPTURE(BM_Feed, plaintext, false)->Range(512, 64 << 10);
+BENCHMARK_CAPTURE(BM_Feed, encrypted, true)->Range(512, 64 << 10);
+
+static void BM_Multi(benchmark::State& state, bool compressed) {
+	Client client;
+	client.client.onPrivateMsg = [](SteamID user, const char* message) {};
+	
+	auto message = Multi(state.range(0), compressed);
+	auto data = reinterpret_cast<const unsigned char*>(message.data());
+	
+	AllocationCounter counter;
+	for (auto _ : state) {
+		SteamClientBench::ReadMessage(client.client, data, message.size());
+	}
+	counter.Report(state);
+	state.SetBytesProcessed(state.iterations() * message.size());
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_CAPTURE(BM_Multi, uncompressed, false)->Range(1, 1024);
+BENCHMARK_CAPTURE(BM_Multi, compressed, true)->Range(1, 1024);
+
+static void BM_HandleMessage(benchmark::State& state, EMsg emsg) {
+	Client client;
+	SetListeners(client.client);
+	
+	auto message = Handled(emsg);
+	auto data = reinterpret_cast<const unsigned char*>(message.data());
+	
+	AllocationCounter counter;
+	for (auto _ : state) {
+		SteamClientBench::ReadMessage(client.client, data, message.size());
+	}
+	counter.Report(state);
+	state.SetBytesProcessed(state.iterations() * message.size());
+}
+BENCHMARK_CAPTURE(BM_HandleMessage, ChannelEncryptRequest, EMsg::ChannelEncryptRequest);
+BENCHMARK_CAPTURE(BM_HandleMessage, ChannelEncryptResult, EMsg::ChannelEncryptResult);
+BENCHMARK_CAPTURE(BM_HandleMessage, Multi, EMsg::Multi);
+BENCHMARK_CAPTURE(BM_HandleMessage, ClientLogOnResponse, EMsg::ClientLogOnResponse);
+BENCHMARK_CAPTURE(BM_HandleMessage, ClientLoggedOff, EMsg::ClientLoggedOff);
+BENCHMARK_CAPTURE(BM_HandleMessage, ClientUpdateMachineAuth, EMsg::ClientUpdateMachineAuth);
+BENCHMARK_CAPTURE(BM_HandleMessage, ClientPersonaState, EMsg::ClientPersonaState);
+BENCHMARK_CAPTURE(BM_HandleMessage, ClientChatMsg, EMsg::ClientChatMsg);
+BENCHMARK_CAPTURE(BM_HandleMessage, ClientChatEnter, EMsg::ClientChatEnter);
+BENCHMARK_CAPTURE(BM_HandleMessage, ClientChatMemberInfo, EMsg::ClientChatMemberInfo);
+BENCHMARK_CAPTURE(BM_HandleMessage, ClientFriendsList, EMsg::ClientFriendsList);
+BENCHMARK_CAPTURE(BM_HandleMessage, ClientFriendMsgIncoming, EMsg::ClientFriendMsgIncoming);
+
+// the same events delivered to a Listener instead of the std::function members
+
+static void BM_HandleMessageListener(benchmark::State& state, EMsg emsg) {
+	// the base class ignores everything, just like SetListeners
+	SteamClient::Listener listener;
+	Client client(false, &listener);
+	
+	auto message = Handled(emsg);
+	auto data = reinterpret_cast<const unsigned char*>(message.data());
+	
+	AllocationCounter counter;
+	for (auto _ : state) {
+		SteamClientBench::ReadMessage(client.client, data, message.size());
+	}
+	counter.Report(state);
+	state.SetBytesProcessed(state.iterations() * message.size());
+}
+BENCHMARK_CAPTURE(BM_HandleMessageListener, ClientPersonaState, EMsg::ClientPersonaState);
+BENCHMARK_CAPTURE(BM_HandleMessageListener, ClientChatMsg, EMsg::ClientChatMsg);
+BENCHMARK_CAPTURE(BM_HandleMessageListener, ClientChatMemberInfo, EMsg::ClientChatMemberInfo);
+BENCHMARK_CAPTURE(BM_HandleMessageListener, ClientFriendMsgIncoming, EMsg::ClientFriendMsgIncoming);
+
+// what setting up each kind of client costs, the std::function members are set with a capture each
+
+static void BM_ClientCallbacks(benchmark::State& state) {
+	AllocationCounter counter;
+	for (auto _ : state) {
+		Client client;
+		SetListeners(client.client);
+		benchmark::DoNotOptimize(&client);
+	}
+	counter.Report(state);
+}
+BENCHMARK(BM_ClientCallbacks);
+
+static void BM_ClientListener(benchmark::State& state) {
+	SteamClient::Listener listener;
+	
+	AllocationCounter counter;
+	for (auto _ : state) {
+		Client client(false, &listener);
+		benchmark::DoNotOptimize(&client);
+	}
+	counter.Report(state);
+}
+BENCHMARK(BM_ClientListener);
+
+
+// jobs, with range(0) of them outstanding
+
+static void BM_JobResponse(benchmark::State& state) {
+	Client client;
+	auto callback = [](EResult result, EMsg emsg, const MessageHeader& header, Buffer body) {
+		benchmark::DoNotOptimize(body.data);
+	};
+	for (auto i = 1; i < state.range(0); i++) {
+		client.client.SendJob(EMsg::ClientServiceMethod, CMsgClientHeartBeat(), callback, 3600);
+	}
+	
+	// jobid_target is the last thing in the header, so it's patched in place for each job
+	auto response = Packet(false, [](CMClient& cmClient) {
+		cmClient.WriteMessage(EMsg::ClientServiceMethodResponse, CMsgClientHeartBeat(), ~0ull);
+	}).substr(8);
+	auto data = reinterpret_cast<unsigned char*>(&response[0]);
+	auto target = data + sizeof(MsgHdrProtoBuf) + reinterpret_cast<const MsgHdrProtoBuf*>(data)->headerLength - 8;
+	
+	AllocationCounter counter;
+	for (auto _ : state) {
+		auto job_id = client.client.SendJob(EMsg::ClientServiceMethod, CMsgClientHeartBeat(), callback, 3600);
+		std::memcpy(target, &job_id, 8);
+		SteamClientBench::ReadMessage(client.client, data, response.size());
+	}
+	counter.Report(state);
+}
+BENCHMARK(BM_JobResponse)->Range(1, 16 << 10);
+
+static void BM_JobTimeout(benchmark::State& state) {
+	Client client;
+	auto& cmClient = SteamClientBench::cmClient(client.client);
+	
+	AllocationCounter counter;
+	for (auto _ : state) {
+		for (auto i = 0; i < state.range(0); i++) {
+			client.client.SendJob(EMsg::ClientServiceMethod, CMsgClientHeartBeat(), [](EResult result, EMsg emsg, const MessageHeader& header, Buffer body) {
+				benchmark::DoNotOptimize(result);
+			}, 1);
+		}
+		cmClient.ExpireJobs(1);
+	}
+	counter.Report(state);
+	state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_JobTimeout)->Range(1, 16 << 10);
+
+
+// outbound
+
+static void BM_WriteMessageStruct(benchmark::State& state, bool encrypted) {
+	Client client(encrypted);
+	auto &cmClient = SteamClientBench::cmClient(client.client);
+	std::string message(state.range(0), 'a');
+	
+	AllocationCounter counter;
+	for (auto _ : state) {
+		cmClient.WriteMessage(EMsg::ClientChatMsg, sizeof(MsgClientChatMsg) + message.size() + 1, [&message](unsigned char* buffer) {
+			auto send_msg = new (buffer) MsgClientChatMsg;
+			send_msg->chatMsgType = static_cast<std::uint32_t>(EChatEntryType::ChatMsg);
+			std::strcpy(reinterpret_cast<char*>(buffer + sizeof(MsgClientChatMsg)), message.c_str());
+		});
+	}
+	counter.Report(state);
+	state.SetBytesProcessed(state.iterations() * message.size());
+}
+BENCHMARK_CAPTURE(BM_WriteMessageStruct, plaintext, false)->Range(16, 64 << 10);
+BENCHMARK_CAPTURE(BM_WriteMessageStruct, encrypted, true)->Range(16, 64 << 10);
+
+static void BM_WriteMessageProtobuf(benchmark::State& state, bool encrypted) {
+	Client client(encrypted);
+	auto &cmClient = SteamClientBench::cmClient(client.client);
+	
+	CMsgClientFriendMsg msg;
+	msg.set_steamid(76561197960287930);
+	msg.set_message(std::string(state.range(0), 'a'));
+	msg.set_chat_entry_type(static_cast<google::protobuf::uint32>(EChatEntryType::ChatMsg));
+	
+	AllocationCounter counter;
+	for (auto _ : state) {
+		cmClient.WriteMessage(EMsg::ClientFriendMsg, msg);
+	}
+	counter.Report(state);
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK_CAPTURE(BM_WriteMessageProtobuf, plaintext, false)->Range(16, 64 << 10);
+BENCHMARK_CAPTURE(BM_WriteMessageProtobuf, encrypted, true)->Range(16, 64 << 10);
+
+
+// body serialization, before and after WriteMessage stopped sizing messages twice
+
+static CMsgClientFriendMsg OutgoingFriendMsg(std::size_t length) {
+	CMsgClientFriendMsg msg;
+	msg.set_steamid(76561197960287930);
+	msg.set_message(std::string(length, 'a'));
+	msg.set_chat_entry_type(static_cast<google::protobuf::uint32>(EChatEntryType::ChatMsg));
+	return msg;
+}
+
+static void BM_SerializeToArray(benchmark::State& state) {
+	auto msg = OutgoingFriendMsg(state.range(0));
+	std::vector<unsigned char> buffer(msg.ByteSize());
+	
+	for (auto _ : state) {
+		auto size = msg.ByteSize();
+		msg.SerializeToArray(buffer.data(), size);
+		benchmark::DoNotOptimize(buffer.data());
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SerializeToArray)->Range(16, 64 << 10);
+
+static void BM_SerializeWithCachedSizes(benchmark::State& state) {
+	auto msg = OutgoingFriendMsg(state.range(0));
+	std::vector<unsigned char> buffer(msg.ByteSize());
+	
+	for (auto _ : state) {
+		msg.ByteSize();
+		msg.SerializeWithCachedSizesToArray(buffer.data());
+		benchmark::DoNotOptimize(buffer.data());
+	}
+	state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_SerializeWithCachedSizes)->Range(16, 64 << 10);
+
+
+// IV generation, before and after CMClient got its own generator
+
+static void BM_IVAutoSeededRandomPool(benchmark::State& state) {
+	AutoSeededRandomPool rnd;
+	byte iv[16];
+	
+	AllocationCounter counter;
+	for (auto _ : state) {
+		rnd.GenerateBlock(iv, sizeof(iv));
+		benchmark::DoNotOptimize(iv);
+	}
+	counter.Report(state);
+	state.SetBytesProcessed(state.iterations() * sizeof(iv));
+}
+BENCHMARK(BM_IVAutoSeededRandomPool);
+
+static void BM_IVGenerator(benchmark::State& state) {
+	Client client(true);
+	auto &cmClient = SteamClientBench::cmClient(client.client);
+	byte iv[16];
+	
+	AllocationCounter counter;
+	for (auto _ : state) {
+		cmClient.GenerateIV(iv);
+		benchmark::DoNotOptimize(iv);
+	}
+	counter.Report(state);
+	state.SetBytesProcessed(state.iterations() * sizeof(iv));
+}
+BENCHMARK(BM_IVGenerator);
+
+BENCHMARK_MAIN();
@@ -0,0 +1,353 @@
+// include after steam++.h, only does anything when compiling as C++20
+
+#if defined(__cpp_impl_coroutine)
+
+#include <coroutine>
+#include <cstddef>
+#include <exception>
+#include <new>
+#include <utility>
+
+namespace Steam {
+	/**
+	 * Where Task frames come from. Freed frames are kept on per-thread lists by size and handed out again,
+	 * so a workflow that's started over and over only allocates the first few times.
+	 */
+	class FramePool {
+	public:
+		static void* Allocate(std::size_t size) {
+			auto size_class = SizeClass(size);
+			if (size_class >= CLASSES) {
+				return ::operator new(size);
+			}
+			
+			auto& head = Lists().heads[size_class];
+			if (!head) {
+				return ::operator new((size_class + 1) * STEP);
+			}
+			auto frame = head;
+			head = frame->next;
+			return frame;
+		}
+		
+		static void Free(void* frame, std::size_t size) {
+			auto size_class = SizeClass(size);
+			if (size_class >= CLASSES) {
+				::operator delete(frame);
+				return;
+			}
+			
+			auto& head = Lists().heads[size_class];
+			head = new (frame) FreeFrame { head };
+		}
+		
+	private:
+		// frames bigger than the last class aren't worth keeping around
+		static const std::size_t STEP = 64;
+		static const std::size_t CLASSES = 64;
+		
+		struct FreeFrame {
+			FreeFrame* next;
+		};
+		
+		struct FreeLists {
+			FreeFrame* heads[CLASSES] = {};
+			
+			~FreeLists() {
+				for (auto head : heads) {
+					while (head) {
+						auto next = head->next;
+						::operator delete(head);
+						head = next;
+					}
+				}
+			}
+		};
+		
+		static std::size_t SizeClass(std::size_t size) {
+			return (size - 1) / STEP;
+		}
+		
+		static FreeLists& Lists() {
+			thread_local FreeLists lists;
+			return lists;
+		}
+	};
+	
+	/**
+	 * Return type of a coroutine that uses CoroutineClient. It starts right away and cleans up after itself
+	 * when it finishes, so there's nothing to hold on to. An exception escaping it terminates.
+	 */
+	struct Task {
+		struct promise_type {
+			Task get_return_object() noexcept { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() noexcept {}
+			void unhandled_exception() noexcept { std::terminate(); }
+			
+			static void* operator new(std::size_t size) {
+				return FramePool::Allocate(size);
+			}
+			
+			static void operator delete(void* frame, std::size_t size) {
+				FramePool::Free(frame, size);
+			}
+		};
+	};
+	
+	/**
+	 * A SteamClient whose responses can be awaited from a Task:
+	 *
+	 *     Steam::Task Session(Steam::CoroutineClient& steam) {
+	 *         co_await steam.Handshake();
+	 *         if (co_await steam.LogOn(username, password) != EResult::OK)
+	 *             co_return;
+	 *         auto chat = co_await steam.JoinChat(room);
+	 *         ...
+	 *     }
+	 *
+	 * The awaiting coroutine is resumed from inside the handler of the response, so anything that comes with
+	 * a result and points into the message is only valid until the coroutine next suspends, just like it's only
+	 * valid until a callback returns. Coroutines still waiting when this is destroyed are destroyed with it.
+	 *
+	 * It's the Listener of its #client, override the other events as usual. If you override #onHandshake,
+	 * #onLogOn or #onChatEnter, call this class's version or their awaiters won't be resumed.
+	 */
+	class CoroutineClient : public SteamClient::Listener {
+		struct Waiter;
+		
+	public:
+		/**
+		 * Constructs #client with @a args followed by this. Because the Listener comes last, pass every argument
+		 * of the SteamClient constructor you want, including the watermarks in queued mode.
+		 */
+		template <typename... Args>
+		explicit CoroutineClient(Args&&... args) : client(std::forward<Args>(args)..., this) {}
+		
+		~CoroutineClient() {
+			for (auto list : { &handshakeWaiters, &logOnWaiters, &chatEnterWaiters, &jobWaiters }) {
+				while (*list) {
+					auto waiter = *list;
+					Unlink(*list, waiter);
+					waiter->handle.destroy();
+				}
+			}
+		}
+		
+		CoroutineClient(const CoroutineClient&) = delete;
+		CoroutineClient& operator=(const CoroutineClient&) = delete;
+		
+		SteamClient client;
+		
+		
+		struct HandshakeAwaiter;
+		struct LogOnAwaiter;
+		struct ChatEnterAwaiter;
+		struct JobAwaiter;
+		
+		/**
+		 * Waits for the next encryption handshake to complete, so await it right after calling #SteamClient::connected.
+		 */
+		HandshakeAwaiter Handshake() {
+			return HandshakeAwaiter(*this);
+		}
+		
+		/**
+		 * Same as #SteamClient::LogOn, and waits for the result.
+		 * The SteamID is #SteamClient::onLogOn's to tell, override it if you need it.
+		 */
+		LogOnAwaiter LogOn(
+			const char* username,
+			const char* password,
+			const unsigned char sentry_hash[20] = nullptr,
+			const char* code = nullptr,
+			SteamID steamID = 0
+		) {
+			client.LogOn(username, password, sentry_hash, code, steamID);
+			return LogOnAwaiter(*this);
+		}
+		
+		struct ChatEnter {
+			EChatRoomEnterResponse response;
+			const char* name;
+			std::size_t memberCount;
+			const ChatMember* members;
+		};
+		
+		/**
+		 * Same as #SteamClient::JoinChat, and waits until @a chat has been entered or entering it failed.
+		 * Any number of chats can be joined at once.
+		 */
+		ChatEnterAwaiter JoinChat(SteamID chat) {
+			client.JoinChat(chat);
+			// a clan is entered as its chat, which is what onChatEnter reports
+			return ChatEnterAwaiter(*this, SteamClient::ChatID(chat));
+		}
+		
+		struct JobResponse {
+			EResult result;
+			EMsg emsg;
+			MessageHeader header;
+			Buffer body;
+		};
+		
+		/**
+		 * Like #SteamClient::SendJob, but the coroutine gets the response. @a message is sent once the coroutine
+		 * has suspended, so it has to live until then, which a temporary in the @c co_await expression does.
+		 */
+		JobAwaiter SendJob(EMsg emsg, const google::protobuf::Message& message, unsigned timeout = 30) {
+			return JobAwaiter(*this, emsg, message, timeout);
+		}
+		
+		
+		void onHandshake() override {
+			Resume(handshakeWaiters, [](Waiter* waiter) {
+				return true;
+			});
+		}
+		
+		void onLogOn(EResult result, SteamID steamID) override {
+			Resume(logOnWaiters, [result](Waiter* waiter) {
+				static_cast<LogOnAwaiter*>(waiter)->result = result;
+				return true;
+			});
+		}
+		
+		void onChatEnter(
+			SteamID room,
+			EChatRoomEnterResponse response,
+			const char* name,
+			std::size_t member_count,
+			const ChatMember members[]
+		) override {
+			Resume(chatEnterWaiters, [&](Waiter* waiter) {
+				auto chat_enter = static_cast<ChatEnterAwaiter*>(waiter);
+				if (chat_enter->room != room) {
+					return false;
+				}
+				chat_enter->chatEnter = ChatEnter { response, name, member_count, members };
+				return true;
+			});
+		}
+		
+		
+	private:
+		// awaiters live in the suspended coroutine's frame, so they're linked in place instead of allocating nodes
+		struct Waiter {
+			Waiter* prev;
+			Waiter* next;
+			std::coroutine_handle<> handle;
+		};
+		
+		Waiter* handshakeWaiters = nullptr;
+		Waiter* logOnWaiters = nullptr;
+		Waiter* chatEnterWaiters = nullptr;
+		Waiter* jobWaiters = nullptr;
+		
+		static void Link(Waiter*& list, Waiter* waiter, std::coroutine_handle<> handle) {
+			waiter->handle = handle;
+			waiter->prev = nullptr;
+			waiter->next = list;
+			if (list) {
+				list->prev = waiter;
+			}
+			list = waiter;
+		}
+		
+		static void Unlink(Waiter*& list, Waiter* waiter) {
+			if (waiter->prev) {
+				waiter->prev->next = waiter->next;
+			} else {
+				list = waiter->next;
+			}
+			if (waiter->next) {
+				waiter->next->prev = waiter->prev;
+			}
+		}
+		
+		// resumes the waiters on @a list that @a match accepts
+		// they're all taken off first, since a resumed coroutine may well await the same thing again
+		template <typename Match>
+		static void Resume(Waiter*& list, Match match) {
+			Waiter* matched = nullptr;
+			for (auto waiter = list; waiter;) {
+				auto next = waiter->next;
+				if (match(waiter)) {
+					Unlink(list, waiter);
+					waiter->next = matched;
+					matched = waiter;
+				}
+				waiter = next;
+			}
+			
+			while (matched) {
+				auto waiter = matched;
+				matched = waiter->next;
+				waiter->handle.resume();
+			}
+		}
+		
+	public:
+		struct HandshakeAwaiter : Waiter {
+			explicit HandshakeAwaiter(CoroutineClient& owner) : owner(owner) {}
+			
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> handle) { Link(owner.handshakeWaiters, this, handle); }
+			void await_resume() const noexcept {}
+			
+			CoroutineClient& owner;
+		};
+		
+		struct LogOnAwaiter : Waiter {
+			explicit LogOnAwaiter(CoroutineClient& owner) : owner(owner) {}
+			
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> handle) { Link(owner.logOnWaiters, this, handle); }
+			EResult await_resume() const noexcept { return result; }
+			
+			CoroutineClient& owner;
+			EResult result;
+		};
+		
+		struct ChatEnterAwaiter : Waiter {
+			ChatEnterAwaiter(CoroutineClient& owner, SteamID room) : owner(owner), room(room) {}
+			
+			bool await_ready() const noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> handle) { Link(owner.chatEnterWaiters, this, handle); }
+			ChatEnter await_resume() const noexcept { return chatEnter; }
+			
+			CoroutineClient& owner;
+			SteamID room;
+			ChatEnter chatEnter;
+		};
+		
+		struct JobAwaiter : Waiter {
+			JobAwaiter(CoroutineClient& owner, EMsg emsg, const google::protobuf::Message& message, unsigned timeout) :
+				owner(owner), emsg(emsg), message(message), timeout(timeout) {}
+			
+			bool await_ready() const noexcept { return false; }
+			
+			void await_suspend(std::coroutine_handle<> handle) {
+				Link(owner.jobWaiters, this, handle);
+				
+				// only a pointer is captured, which std::function stores without allocating
+				owner.client.SendJob(emsg, message, [this](EResult result, EMsg emsg, const MessageHeader& header, Buffer body) {
+					response = JobResponse { result, emsg, header, body };
+					Unlink(owner.jobWaiters, this);
+					this->handle.resume();
+				}, timeout);
+			}
+			
+			JobResponse await_resume() const noexcept { return response; }
+			
+			CoroutineClient& owner;
+			EMsg emsg;
+			const google::protobuf::Message& message;
+			unsigned timeout;
+			JobResponse response;
+		};
+	};
+}
+
+#endif
@@ -0,0 +1,80 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "steam++.h"
+#include "steam++_coroutine.h"
+#include "steam++_messages.h"
+
+// feeds CoroutineClient the responses a CM would send and checks that the right coroutines resume
+
+using namespace Steam;
+
+namespace {
+	// an unencrypted VT01 packet holding a ClientChatEnter for @a chat
+	std::vector<unsigned char> ChatEnterPacket(SteamID chat, EChatRoomEnterResponse response, const char* name) {
+		std::vector<unsigned char> packet(8 + sizeof(ExtendedClientMsgHdr) + sizeof(MsgClientChatEnter) + 4 + std::strlen(name) + 1);
+		auto length = static_cast<std::uint32_t>(packet.size() - 8);
+		std::memcpy(&packet[0], &length, 4);
+		std::memcpy(&packet[4], "VT01", 4);
+		
+		ExtendedClientMsgHdr header;
+		header.msg = static_cast<std::uint32_t>(EMsg::ClientChatEnter);
+		std::memcpy(&packet[8], &header, sizeof(header));
+		
+		MsgClientChatEnter enter;
+		enter.steamIdChat = chat;
+		enter.enterResponse = static_cast<std::uint32_t>(response);
+		auto body = &packet[8 + sizeof(header)];
+		std::memcpy(body, &enter, sizeof(enter));
+		
+		std::uint32_t member_count = 0;
+		std::memcpy(body + sizeof(enter), &member_count, 4);
+		std::strcpy(reinterpret_cast<char*>(body + sizeof(enter) + 4), name);
+		return packet;
+	}
+	
+	Task EnterChat(CoroutineClient& steam, SteamID chat, bool& entered) {
+		auto chat_enter = co_await steam.JoinChat(chat);
+		entered = chat_enter.response == EChatRoomEnterResponse::Success && !std::strcmp(chat_enter.name, "clan");
+	}
+	
+	int failures;
+	
+	void Check(bool condition, const char* what) {
+		if (!condition) {
+			std::printf("FAILED: %s\n", what);
+			failures++;
+		}
+	}
+}
+
+int main() {
+	CoroutineClient steam(
+		[](std::size_t length, std::function<void(unsigned char* buffer)> fill) {
+			std::vector<unsigned char> buffer(length);
+			fill(buffer.data());
+		},
+		[](std::function<void()> callback, int timeout) {}
+	);
+	steam.client.connected();
+	
+	SteamID clan = 103582791432594962ull;
+	auto chat = SteamClient::ChatID(clan);
+	Check(chat != clan, "a clan has a chat of its own");
+	
+	bool entered = false;
+	EnterChat(steam, clan, entered);
+	
+	// some other chat doesn't resume it
+	auto other = ChatEnterPacket(110338190871147670ull, EChatRoomEnterResponse::Success, "other");
+	steam.client.feed(other.data(), other.size());
+	Check(!entered, "entering another chat resumes a clan join");
+	
+	auto packet = ChatEnterPacket(chat, EChatRoomEnterResponse::Success, "clan");
+	steam.client.feed(packet.data(), packet.size());
+	Check(entered, "entering a clan's chat resumes its join");
+	
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,104 @@
+#include <type_traits>
+
+#include "steam_language/steam_language_internal.h"
+#include "steammessages_clientserver.pb.h"
+
+// include after steam++.h to use SteamClient::on, and only once as it pulls in steam_language_internal.h
+
+namespace Steam {
+	/**
+	 * The body type of @a emsg messages: a protobuf message, or a struct from steam_language_internal.h
+	 * that's followed by a variable-length payload. Specialize it for any EMsg that's missing.
+	 */
+	template <EMsg emsg>
+	struct MessageType;
+	
+#define STEAM_MESSAGE_TYPE(emsg, message_type) \
+	template <> \
+	struct MessageType<EMsg::emsg> { \
+		typedef message_type type; \
+	};
+	
+	STEAM_MESSAGE_TYPE(Multi, CMsgMulti)
+	STEAM_MESSAGE_TYPE(ChannelEncryptRequest, MsgChannelEncryptRequest)
+	STEAM_MESSAGE_TYPE(ChannelEncryptResponse, MsgChannelEncryptResponse)
+	STEAM_MESSAGE_TYPE(ChannelEncryptResult, MsgChannelEncryptResult)
+	STEAM_MESSAGE_TYPE(ClientHeartBeat, CMsgClientHeartBeat)
+	STEAM_MESSAGE_TYPE(ClientLogon, CMsgClientLogon)
+	STEAM_MESSAGE_TYPE(ClientLogOnResponse, CMsgClientLogonResponse)
+	STEAM_MESSAGE_TYPE(ClientLoggedOff, CMsgClientLoggedOff)
+	STEAM_MESSAGE_TYPE(ClientNewLoginKey, MsgClientNewLoginKey)
+	STEAM_MESSAGE_TYPE(ClientNewLoginKeyAccepted, MsgClientNewLoginKeyAccepted)
+	STEAM_MESSAGE_TYPE(ClientUpdateMachineAuth, CMsgClientUpdateMachineAuth)
+	STEAM_MESSAGE_TYPE(ClientUpdateMachineAuthResponse, CMsgClientUpdateMachineAuthResponse)
+	STEAM_MESSAGE_TYPE(ClientVACBanStatus, MsgClientVACBanStatus)
+	STEAM_MESSAGE_TYPE(ClientEmailAddrInfo, MsgClientEmailAddrInfo)
+	STEAM_MESSAGE_TYPE(ClientServerUnavailable, MsgClientServerUnavailable)
+	STEAM_MESSAGE_TYPE(ClientChangeStatus, CMsgClientChangeStatus)
+	STEAM_MESSAGE_TYPE(ClientPersonaState, CMsgClientPersonaState)
+	STEAM_MESSAGE_TYPE(ClientRequestFriendData, CMsgClientRequestFriendData)
+	STEAM_MESSAGE_TYPE(ClientFriendsList, CMsgClientFriendsList)
+	STEAM_MESSAGE_TYPE(ClientFriendMsg, CMsgClientFriendMsg)
+	STEAM_MESSAGE_TYPE(ClientFriendMsgIncoming, CMsgClientFriendMsgIncoming)
+	STEAM_MESSAGE_TYPE(ClientSetIgnoreFriend, MsgClientSetIgnoreFriend)
+	STEAM_MESSAGE_TYPE(ClientSetIgnoreFriendResponse, MsgClientSetIgnoreFriendResponse)
+	STEAM_MESSAGE_TYPE(ClientGetFriendsWhoPlayGame, MsgClientGetFriendsWhoPlayGame)
+	STEAM_MESSAGE_TYPE(ClientGetFriendsWhoPlayGameResponse, MsgClientGetFriendsWhoPlayGameResponse)
+	STEAM_MESSAGE_TYPE(ClientGetNumberOfCurrentPlayers, MsgClientGetNumberOfCurrentPlayers)
+	STEAM_MESSAGE_TYPE(ClientGetNumberOfCurrentPlayersResponse, MsgClientGetNumberOfCurrentPlayersResponse)
+	STEAM_MESSAGE_TYPE(ClientJoinChat, MsgClientJoinChat)
+	STEAM_MESSAGE_TYPE(ClientChatEnter, MsgClientChatEnter)
+	STEAM_MESSAGE_TYPE(ClientChatMsg, MsgClientChatMsg)
+	STEAM_MESSAGE_TYPE(ClientChatMemberInfo, MsgClientChatMemberInfo)
+	STEAM_MESSAGE_TYPE(ClientChatAction, MsgClientChatAction)
+	STEAM_MESSAGE_TYPE(ClientChatActionResult, MsgClientChatActionResult)
+	STEAM_MESSAGE_TYPE(ClientSendGuestPass, MsgClientSendGuestPass)
+	STEAM_MESSAGE_TYPE(ClientSendGuestPassResponse, MsgClientSendGuestPassResponse)
+	STEAM_MESSAGE_TYPE(ClientUpdateGuestPassesList, MsgClientUpdateGuestPassesList)
+	STEAM_MESSAGE_TYPE(ClientAppUsageEvent, MsgClientAppUsageEvent)
+	STEAM_MESSAGE_TYPE(ClientRequestedClientStats, MsgClientRequestedClientStats)
+	STEAM_MESSAGE_TYPE(ClientP2PIntroducerMessage, MsgClientP2PIntroducerMessage)
+	STEAM_MESSAGE_TYPE(ClientOGSBeginSession, MsgClientOGSBeginSession)
+	STEAM_MESSAGE_TYPE(ClientOGSBeginSessionResponse, MsgClientOGSBeginSessionResponse)
+	STEAM_MESSAGE_TYPE(ClientOGSEndSession, MsgClientOGSEndSession)
+	STEAM_MESSAGE_TYPE(ClientOGSEndSessionResponse, MsgClientOGSEndSessionResponse)
+	STEAM_MESSAGE_TYPE(ClientOGSWriteRow, MsgClientOGSWriteRow)
+	STEAM_MESSAGE_TYPE(GSPerformHardwareSurvey, MsgGSPerformHardwareSurvey)
+	STEAM_MESSAGE_TYPE(GSGetPlayStatsResponse, MsgGSGetPlayStatsResponse)
+	STEAM_MESSAGE_TYPE(GSGetReputationResponse, MsgGSGetReputationResponse)
+	STEAM_MESSAGE_TYPE(GSDeny, MsgGSDeny)
+	STEAM_MESSAGE_TYPE(GSApprove, MsgGSApprove)
+	STEAM_MESSAGE_TYPE(GSKick, MsgGSKick)
+	STEAM_MESSAGE_TYPE(GSGetUserGroupStatus, MsgGSGetUserGroupStatus)
+	STEAM_MESSAGE_TYPE(GSGetUserGroupStatusResponse, MsgGSGetUserGroupStatusResponse)
+	
+	template <EMsg emsg, typename Handler>
+	void SteamClient::on(Handler handler) {
+		// the only type erasure is the handler table's, yours is called directly
+		RegisterHandler(emsg, [this, handler](const MessageHeader& header, const unsigned char* data, std::size_t length) mutable {
+			Parse<emsg>(header, data, length, handler);
+		});
+	}
+	
+	template <EMsg emsg, typename Handler>
+	void SteamClient::Parse(const MessageHeader& header, const unsigned char* data, std::size_t length, Handler&& handler) {
+		typedef typename MessageType<emsg>::type Message;
+		ParseMessage<Message>(emsg, header, data, length, handler, std::is_base_of<google::protobuf::Message, Message>());
+	}
+	
+	template <typename Message, typename Handler>
+	void SteamClient::ParseMessage(EMsg emsg, const MessageHeader& header, const unsigned char* data, std::size_t length, Handler& handler, std::true_type) {
+		auto& message = static_cast<Message&>(NewMessage(emsg, Message::default_instance(), length));
+		message.ParseFromArray(data, length);
+		handler(header, const_cast<const Message&>(message));
+	}
+	
+	template <typename Message, typename Handler>
+	void SteamClient::ParseMessage(EMsg emsg, const MessageHeader& header, const unsigned char* data, std::size_t length, Handler& handler, std::false_type) {
+		if (length < sizeof(Message)) {
+			// too short to hold the struct
+			return;
+		}
+		handler(header, *reinterpret_cast<const Message*>(data), data + sizeof(Message), length - sizeof(Message));
+	}
+}
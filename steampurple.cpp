@@ -22,9 +22,8 @@ struct SteamPurple {
 	SteamClient client;
 	
 	int fd;
-	std::vector<unsigned char> read_buffer;
+	unsigned char read_buffer[65536];
 	std::vector<unsigned char> write_buffer;
-	std::vector<unsigned char>::size_type read_offset;
 	guint watcher;
 	PurpleProxyConnectData *connect_data;
 	
@@ -47,12 +46,11 @@ static void steam_connect(PurpleAccount *account, SteamPurple* steam) {
 			return;
 		}
 		steam->fd = source;
-		auto next_length = steam->client.connected();
-		steam->read_buffer.resize(next_length);
+		steam->client.connected();
 		steam->watcher = purple_input_add(source, PURPLE_INPUT_READ, [](gpointer data, gint source, PurpleInputCondition cond) {
 			auto pc = (PurpleConnection *)data;
 			auto steam = reinterpret_cast<SteamPurple*>(purple_connection_get_protocol_data(pc));
-			auto len = read(source, &steam->read_buffer[steam->read_offset], steam->read_buffer.size() - steam->read_offset);
+			auto len = read(source, steam->read_buffer, sizeof(steam->read_buffer));
 			purple_debug_info("steam", "read: %i\n", len);
 			// len == 0: preceded by a ClientLoggedOff or ClientLogOnResponse, socket should be already closed by us
 			if (len == -1) {
@@ -62,12 +60,7 @@ static void steam_connect(PurpleAccount *account, SteamPurple* steam) {
 				return;
 			}
 			assert(len > 0);
-			steam->read_offset += len;
-			if (steam->read_offset == steam->read_buffer.size()) {
-				auto next_len = steam->client.readable(steam->read_buffer.data());
-				steam->read_offset = 0;
-				steam->read_buffer.resize(next_len);
-			}
+			steam->client.feed(steam->read_buffer, len);
 		}, pc);
 	}, purple_account_get_connection(account));
 	assert(steam->connect_data);
@@ -8,24 +8,34 @@ using namespace Steam;
 uv_tcp_t sock;
 uv_timer_t timer;
 
-std::string read_buffer;
-std::string write_buffer;
+char read_buffer[65536];
 
-std::string::size_type read_offset = 0;
+uv_write_t write_req;
+std::size_t write_length = 0; // non-zero while a write is in flight
 
 extern SteamClient client;
 
+void write_pending() {
+	auto pending = client.pending();
+	write_length = pending.length;
+	if (!write_length) {
+		return;
+	}
+	
+	// stays valid until we call sent, no matter how much gets queued meanwhile
+	auto buf = uv_buf_init(const_cast<char*>(reinterpret_cast<const char*>(pending.data)), pending.length);
+	uv_write(&write_req, (uv_stream_t*)&sock, &buf, 1, [](uv_write_t* req, int status) {
+		client.sent(write_length);
+		write_pending();
+	});
+}
+
 SteamClient client(
-	// write callback
-	[](std::size_t length, std::function<void(unsigned char* buffer)> fill) {
-		auto write = new uv_write_t;
-		// TODO: check if previous write has finished
-		write_buffer.resize(length);
-		fill(reinterpret_cast<unsigned char*>(&write_buffer[0]));
-		auto buf = uv_buf_init(&write_buffer[0], write_buffer.size());
-		uv_write(write, (uv_stream_t*)&sock, &buf, 1, [](uv_write_t* req, int status) {
-			delete req;
-		});
+	// want_write callback
+	[] {
+		if (!write_length) {
+			write_pending();
+		}
 	},
 	// set_inverval callback
 	[](std::function<void()> callback, int timeout) {
@@ -48,20 +58,15 @@ int main() {
 	sockaddr_in addr;
 	uv_ip4_addr(endpoint.host, endpoint.port, &addr);
 	uv_tcp_connect(connect, &sock, (sockaddr*)&addr, [](uv_connect_t* req, int status) {
-		auto length = client.connected();
-		read_buffer.resize(length);
+		client.connected();
 		uv_read_start(req->handle, [](uv_handle_t* handle, size_t suggested_size, uv_buf_t* buf) {
-			*buf = uv_buf_init(&read_buffer[read_offset], read_buffer.size() - read_offset);
+			*buf = uv_buf_init(read_buffer, sizeof(read_buffer));
 		}, [](uv_stream_t* stream, ssize_t nread, const uv_buf_t* buf) {
 			if (nread < 1) {
 				auto str = uv_strerror(nread);
+				return;
 			}
-			read_offset += nread;
-			if (read_offset == read_buffer.size()) {
-				auto next_length = client.readable(reinterpret_cast<unsigned char*>(&read_buffer[0]));
-				read_offset = 0;
-				read_buffer.resize(next_length);
-			}
+			client.feed(reinterpret_cast<unsigned char*>(buf->base), nread);
 		});
 		delete req;
 	});
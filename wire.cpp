@@ -0,0 +1,79 @@
+#include <cstring>
+
+#include "wire.h"
+
+WireReader::WireReader(const unsigned char* data, std::size_t length) : position(data), end(data + length), failed(false) {}
+
+bool WireReader::Next(WireField& field) {
+	if (position == end || failed) {
+		return false;
+	}
+	
+	std::uint64_t tag;
+	if (!ReadVarint(tag)) {
+		return false;
+	}
+	
+	field.number = tag >> 3;
+	field.type = static_cast<WireType>(tag & 7);
+	
+	switch (field.type) {
+	case WireType::Varint:
+		return ReadVarint(field.value);
+		
+	case WireType::Fixed64:
+		if (end - position < 8) {
+			break;
+		}
+		// the wire format is little-endian, like everything else we run on
+		std::memcpy(&field.value, position, 8);
+		position += 8;
+		return true;
+		
+	case WireType::Fixed32:
+		if (end - position < 4) {
+			break;
+		}
+		{
+			std::uint32_t value;
+			std::memcpy(&value, position, 4);
+			field.value = value;
+		}
+		position += 4;
+		return true;
+		
+	case WireType::LengthDelimited:
+		if (!ReadVarint(field.value)) {
+			return false;
+		}
+		if (static_cast<std::uint64_t>(end - position) < field.value) {
+			break;
+		}
+		field.data = position;
+		field.length = field.value;
+		position += field.length;
+		return true;
+	}
+	
+	// groups, unknown wire types and truncated fields
+	failed = true;
+	return false;
+}
+
+bool WireReader::Failed() const {
+	return failed;
+}
+
+bool WireReader::ReadVarint(std::uint64_t& value) {
+	value = 0;
+	for (unsigned shift = 0; shift < 64 && position != end; shift += 7) {
+		auto byte = *position++;
+		value |= static_cast<std::uint64_t>(byte & 0x7F) << shift;
+		if (!(byte & 0x80)) {
+			return true;
+		}
+	}
+	
+	failed = true;
+	return false;
+}
@@ -0,0 +1,35 @@
+#include <cstddef>
+#include <cstdint>
+
+// just enough of the protobuf wire format to pick fields out of a message without parsing (and copying) all of it
+
+enum class WireType : std::uint32_t {
+	Varint = 0,
+	Fixed64 = 1,
+	LengthDelimited = 2,
+	Fixed32 = 5
+};
+
+struct WireField {
+	std::uint32_t number;
+	WireType type;
+	std::uint64_t value; // varints and fixed
+	const unsigned char* data; // length-delimited, points into the message
+	std::size_t length;
+};
+
+class WireReader {
+public:
+	WireReader(const unsigned char* data, std::size_t length);
+	
+	// false at the end of the message or if it's malformed, see Failed
+	bool Next(WireField& field);
+	bool Failed() const;
+	
+private:
+	bool ReadVarint(std::uint64_t& value);
+	
+	const unsigned char* position;
+	const unsigned char* end;
+	bool failed;
+};